@@ -37,39 +37,36 @@ die() {
 	exit ${2:-1}
 }
 
-# Returns 0 if "case" pattern $1 matches at least one of the following
-# arguments, otherwise returns 1.
-case_match() {
-	local patt="${1%|}"; shift
-	[ "$patt" ] || return 1
-
-	local str; for str in "$@"; do
-		eval "case \"$str\" in $patt) return 0;; *);; esac"
-	done
-	return 1
+# Formats $@ for "case" pattern (including sanitization).
+case_patt() {
+	printf '%s\n' "$@" | sed -e 's/[();| ]/\\&/g' | tr '\n' '|'
 }
 
-# Prints arguments that match the "case" pattern. Returns 0 if at least one
-# match is found.
-# $1: case pattern
-# $@: elements to test
-case_filter() {
-	local patt="${1%|}"; shift
-	local retval=1
-	[ "$patt" ] || return 1
-
-	local str; for str in "$@"; do
-		if eval "case \"$str\" in $patt) true;; *) false;; esac"; then
-			printf '%s\n' "$str"
-			retval=0
-		fi
-	done
-	return $retval
+# Quotes $1 for use in shell code.
+shell_quote() {
+	printf '%s\n' "$1" | sed "s/'/'\\\\''/g; 1s/^/'/; \$s/\$/'/"
 }
 
-# Formats $@ for "case" pattern (including sanitization).
-case_patt() {
-	printf '%s\n' "$@" | sed -e 's/[();| ]/\\&/g' | tr '\n' '|'
+# Defines function $1 that returns 0 if any of its arguments matches any of
+# the shell patterns, otherwise returns 1. The patterns are compiled into
+# a "case" statement just once, so matching doesn't fork nor eval anything.
+# $1: name of the function to define
+# $2: whitespace separated list of shell patterns
+case_compile() {
+	local name="$1"
+	local patt=$(set -f; case_patt $2)
+	patt="${patt%|}"
+
+	if [ "$patt" ]; then
+		eval "$name() {
+			local str; for str in \"\$@\"; do
+				case \"\$str\" in $patt) return 0;; esac
+			done
+			return 1
+		}"
+	else
+		eval "$name() { return 1; }"
+	fi
 }
 
 # Returns 0 if item $1 is contained in list $@, otherwise returns 1.
@@ -102,17 +99,80 @@ proc_exe() {
 	printf '%s\n' "${path%.apk-new}"
 }
 
-# Prints PIDs of processes that use (maps into memory) files which have been
-# deleted or replaced (with different content) on disk.
+# Returns 0 if the pressure stall information ("some avg10") of any of the
+# resources, system-wide or of the cgroup of this process, is above the
+# threshold, otherwise returns 1. The cgroup is read just once, into
+# $_pressure_cgroup.
+# $1: whitespace separated list of RESOURCE=PERCENT (cpu, io, memory)
+pressure_exceeded() {
+	[ -n "$1" ] || return 1
+
+	if [ -z "${_pressure_cgroup+x}" ]; then
+		_pressure_cgroup=$(sed -n 's|^0::/||p' /proc/$$/cgroup 2>/dev/null) || :
+	fi
+	local cgroup="$_pressure_cgroup"
+	local limit res file
+
+	for limit in $1; do
+		res="${limit%%=*}"
+		for file in /proc/pressure/$res ${cgroup:+"/sys/fs/cgroup/$cgroup/$res.pressure"}; do
+			[ -r "$file" ] || continue
+			awk -v max="${limit#*=}" '
+				BEGIN { rc = 1 }
+				$1 == "some" { sub(/^avg10=/, "", $2); if ($2 + 0 > max + 0) rc = 0 }
+				END { exit rc }
+			' "$file" && return 0
+		done
+	done
+	return 1
+}
+
+# Waits until the pressure is below the thresholds (see pressure_exceeded),
+# checking it every 5 seconds. Returns 1 if it's still above after the
+# timeout, otherwise returns 0.
+# $1: whitespace separated list of RESOURCE=PERCENT (cpu, io, memory)
+# $2: timeout in seconds
+wait_for_pressure() {
+	local limits="$1"
+	local timeout="${2:-0}"
+	local waited=0
+
+	[ -n "$limits" ] || return 0
+
+	while pressure_exceeded "$limits"; do
+		[ $waited -lt $timeout ] || return 1
+		[ $waited -gt 0 ] || edebug "System is under pressure, waiting up to $timeout seconds"
+		sleep 5
+		waited=$((waited + 5))
+	done
+	return 0
+}
+
+# Prints processes that use (maps into memory) files which have been deleted
+# or replaced (with different content) on disk, one per line as
+# "PID<TAB>EXE<TAB>CMDLINE". Workers of a daemon are collapsed into its master
+# process.
 # $1: patterns to exclude/include certain paths from checking
+# $@: additional options for procs-need-restart
 procs_using_modified_files() {
 	local retval=0
 
 	set -f  # disable globbing
-	local opts=$(printf -- '-f %s ' ${1:-*})
-
-	edebug "Executing: procs-need-restart $opts"
-	procs-need-restart $opts || retval=$?
+	local opts=$(printf -- '-f %s ' ${1:-*}); shift
+	opts="$opts $*"
+
+	edebug "Executing: procs-need-restart -0 -g $opts"
+	procs-need-restart -0 -g $opts | tr '\0' '\n' | awk '
+		$0 == "" {
+			if (pid) printf("%s\t%s\t%s\n", pid, exe, cmdline)
+			pid = exe = cmdline = ""
+			next
+		}
+		{ key = $0; sub(/=.*/, "", key); sub(/^[^=]*=/, "") }
+		key == "pid" { pid = $0 }
+		key == "exe" { exe = $0 }
+		key == "cmdline" { cmdline = $0 }
+	' || retval=$?
 
 	set +f  # enable globbing
 	return $retval
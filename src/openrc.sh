@@ -10,6 +10,25 @@ find_service_by_pid() {
 	rc-service-pid "$pid"
 }
 
+# Prints options for procs-need-restart selecting processes of started
+# services: cgroups created by OpenRC, and process trees of services with
+# a pidfile, but no cgroup.
+services_procs_opts() {
+	local dir svc pid
+
+	for dir in /sys/fs/cgroup/openrc.* /sys/fs/cgroup/unified/openrc.* /sys/fs/cgroup/openrc/*; do
+		[ -f "$dir"/cgroup.procs ] && printf -- '-c %s\n' "$dir"
+	done
+
+	edebug 'Executing: rc-service-pid'
+	rc-service-pid | while read -r svc pid; do
+		[ -d /sys/fs/cgroup/openrc.$svc ] \
+			|| [ -d /sys/fs/cgroup/unified/openrc.$svc ] \
+			|| [ -d /sys/fs/cgroup/openrc/$svc ] \
+			|| printf -- '-p %d\n' "$pid"
+	done
+}
+
 # Controls OpenRC service.
 # $1: service name
 # $2+: options to pass into the init script
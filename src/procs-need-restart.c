@@ -22,6 +22,7 @@
  * THE SOFTWARE.
  */
 #define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE  // mincore(2), syscall(2)
 
 #include <assert.h>
 #include <ctype.h>
@@ -29,18 +30,37 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fnmatch.h>
+#include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef WITH_IO_URING
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#endif
+
+extern char **environ;
+
 #ifndef PROCFS_PATH
 #define PROCFS_PATH            "/proc"
 #endif
@@ -51,20 +71,103 @@
 
 #define PROGNAME               "procs-need-restart"
 
+// Magic numbers of filesystems with anonymous device numbers, see statfs(2).
+#ifndef BTRFS_SUPER_MAGIC
+#define BTRFS_SUPER_MAGIC      0x9123683e
+#endif
+#ifndef OVERLAYFS_SUPER_MAGIC
+#define OVERLAYFS_SUPER_MAGIC  0x794c7630
+#endif
+
+#define PROC_DIR_PATH          PROCFS_PATH "/%u"
 #define PROC_EXE_PATH          PROCFS_PATH "/%u/exe"
 #define PROC_MAPS_PATH         PROCFS_PATH "/%u/maps"
 #define PROC_MAP_FILES_PATH    PROCFS_PATH "/%u/map_files/%lx-%lx"
+#define PROC_CMDLINE_PATH      PROCFS_PATH "/%u/cmdline"
+#define PROC_FD_PATH           PROCFS_PATH "/%u/fd"
+#define PROC_SMAPS_PATH        PROCFS_PATH "/%u/smaps"
+#define PROC_STAT_PATH         PROCFS_PATH "/%u/stat"
+#define PROC_NS_MNT_PATH       PROCFS_PATH "/%u/ns/mnt"
+#define PROC_ROOT_DIR_PATH     PROCFS_PATH "/%u/root"
 #define PROC_ROOT_PATH         PROCFS_PATH "/%u/root/%s"
+#define PROC_MOUNTINFO_PATH    PROCFS_PATH "/%u/mountinfo"
+#define PROC_SELF_MOUNTINFO_PATH PROCFS_PATH "/self/mountinfo"
+#define PROC_SELF_EXE_PATH     PROCFS_PATH "/self/exe"
 
+// Hidden first argument that runs this program as a helper comparing files
+// for cmp_files_timed().
+#define CMP_HELPER_ARG         "--cmp-helper"
+
+#define EXIT_FOUND             2
 #define EXIT_WRONG_USAGE       100
 #define RET_ERROR              -1
 
+// Result of a comparison in the fast mode when the file on disk is not the
+// mapped one, but the contents have not been compared.
+#define CMP_SUSPECTED          2
+// Result of a comparison that has not been resolved (yet).
+#define CMP_PENDING            3
+// Result of a comparison that has not finished in time.
+#define CMP_UNKNOWN            4
+
 #define FLAG_VERBOSE           0x0001
 #define FLAG_IGNORE_EACCES     0x0002
+#define FLAG_SERVE             0x0004
+#define FLAG_QUIET             0x0008
+#define FLAG_TIMING            0x0010
+#define FLAG_FAST              0x0020
+#define FLAG_GROUP             0x0040
+#define FLAG_COST              0x0080
+#define FLAG_FDS               0x0100
+#define FLAG_JSON              0x0200
+#define FLAG_NUL               0x0400
+#define FLAG_BY_FILE           0x0800
+
+// Policies for mapped files by type of the filesystem (-P).
+#define FS_POLICY_COMPARE      0
+#define FS_POLICY_CHANGED      1
+#define FS_POLICY_UNCHANGED    2
+#define FS_POLICY_SKIP         3
+
+// Reasons of a report.
+#define REASON_EXE             0
+#define REASON_MAP             1
+#define REASON_FD              2
+
+#define CGROUP_PROCS_FILE      "cgroup.procs"
+#define CGROUP_ROOT_PATH       "/sys/fs/cgroup"
+#define PROC_SELF_CGROUP_PATH  PROCFS_PATH "/self/cgroup"
+#define PRESSURE_PATH          PROCFS_PATH "/pressure/%s"
+
+// Interval in seconds of checking the pressure stall information (-L); the
+// kernel updates its averages every 2 seconds.
+#define PRESSURE_CHECK_INTERVAL  1
 
 // Length of highest pid_t (int) value encoded as a decimal number.
 #define PID_STR_MAX            10
 
+// Initial number of buckets in a cache.
+#define CACHE_INIT_SIZE        256
+
+// Size of a window of the compared files mapped at once.
+#define CMP_WINDOW_SIZE        (8 * 1024 * 1024)
+// Files larger than this are compared by reading into a fixed pair of
+// buffers instead of mapping them; it's lower on 32-bit systems, where the
+// address space is tight.
+#define CMP_MMAP_MAX_SIZE      (sizeof(void *) < 8 ? 64 * 1024 * 1024 : 1024 * 1024 * 1024)
+// Size of each of the buffers used for reading the compared files.
+#define CMP_BUFFER_SIZE        (256 * 1024)
+// Size of a step of the comparison paced by the throttle, it's also counted
+// as one I/O operation (for each file).
+#define THROTTLE_STEP_SIZE     (1024 * 1024)
+
+#ifdef WITH_IO_URING
+// Number of chunks (of both files) being read at once in a comparison.
+#define URING_DEPTH            8
+// Size of a chunk read by one request.
+#define URING_CHUNK_SIZE       (128 * 1024)
+#endif
+
 
 #define STR_(x) #x
 #define STR(x) STR_(x)
@@ -95,25 +198,451 @@ static const char *HELP_MSG =
 	"             leading \"!\" for negative match (exclude). This option may be\n"
 	"             repeated.\n"
 	"\n"
+	"  -S, --serve\n"
+	"             Run as a coprocess: read requests from STDIN, one per line,\n"
+	"             and write results to STDOUT.  A request is a whitespace\n"
+	"             separated list of PIDs, or \"*\" to scan all processes.\n"
+	"             Each result is terminated by a line \"=STATUS\", where\n"
+	"             STATUS is the exit status the request would end with.\n"
+	"\n"
+	"  -c, --cgroup DIR\n"
+	"             Scan only processes in the cgroup (v2) directory DIR or its\n"
+	"             descendants.  This option may be repeated.\n"
+	"\n"
+	"  -e, --exe PATT*\n"
+	"             Scan only processes with executable matching the pattern.\n"
+	"             Syntax is the same as for -f.  This option may be repeated.\n"
+	"\n"
+	"  -p, --tree PID\n"
+	"             Scan only process PID and its descendants.  This option may\n"
+	"             be repeated.\n"
+	"\n"
+	"  -u, --uid UID\n"
+	"             Scan only processes owned by the user (name or UID).  This\n"
+	"             option may be repeated.\n"
+	"\n"
+	"  -d, --deleted-fds\n"
+	"             Report also deleted regular files that are still held open\n"
+	"             by the processes, with marks \"fd\" and \"size=N\" (bytes).\n"
+	"             The total is printed to STDERR.\n"
+	"\n"
+	"  -F, --fast\n"
+	"             Don't compare contents of the files, just check if the path\n"
+	"             of a deleted file now resolves to a different file. Such\n"
+	"             processes are reported as \"suspected\".\n"
+	"\n";
+
+// The help is split in two, because C99 compilers are required to support
+// only string literals up to 4095 characters.
+static const char *HELP_MSG_TAIL =
+	"  -P, --fs-policy TYPE=POLICY\n"
+	"             Don't compare files on filesystem TYPE (e.g. nfs, fuse),\n"
+	"             but assume they are \"changed\" or \"unchanged\", or \"skip\"\n"
+	"             them altogether.  This option may be repeated.\n"
+	"\n"
+	"  -b, --by-file\n"
+	"             Report stale files instead of processes: each file with\n"
+	"             PIDs of the processes that use it and mark \"procs=N\".\n"
+	"             Implies -v.\n"
+	"\n"
+	"  -g, --group\n"
+	"             Report affected processes collapsed into their top-most\n"
+	"             ancestor with the same executable and session (e.g. master\n"
+	"             process of a daemon with workers), with mark \"procs=N\",\n"
+	"             where N is number of the affected processes in the group.\n"
+	"\n"
+	"  -j, --jobs N\n"
+	"             Compare up to N files in parallel (default is 1).  Each\n"
+	"             unique file is compared only once, in order of the device.\n"
+	"\n"
+	"  -R, --max-read-rate MB\n"
+	"             Limit reading of the compared files to MB MiB per second.\n"
+	"\n"
+	"  -I, --max-iops N\n"
+	"             Limit reads of the compared files (each started 1 MiB of\n"
+	"             a file counts as one) and maps of processes to N per second.\n"
+	"\n"
+	"  -L, --max-pressure RES=PCT\n"
+	"             Pause the reads while pressure of RES (cpu, io, memory)\n"
+	"             is above PCT %.  This option may be repeated.\n"
+	"\n"
+	"  -D, --deadline SECS\n"
+	"             Stop the scan after SECS seconds (see -T).\n"
+	"\n"
+	"  -T, --timeout SECS\n"
+	"             Report a file not compared in SECS seconds as \"unknown\".\n"
+	"\n"
+	"  -m, --cost\n"
+	"             Report memory (RSS and PSS in kB) used by the stale mappings\n"
+	"             of the affected processes, with marks \"rss=N\" and \"pss=N\".\n"
+	"             The total is printed to STDERR.\n"
+	"\n"
+	"  -q, --quiet\n"
+	"             Don't print anything, just exit with status 2 as soon as\n"
+	"             the first affected process is found.\n"
+	"\n"
+	"  -o, --format FMT\n"
+	"             Output format: \"text\" (default), \"json\" (one object per\n"
+	"             line) or \"nul\" (key=value fields terminated by NUL, each\n"
+	"             record terminated by an extra NUL).  The machine-readable\n"
+	"             formats include more fields, see the man page.\n"
+	"\n"
+	"  -0         Same as --format=nul.\n"
+	"\n"
+	"  -t, --timing\n"
+	"             Print number of scanned processes, compared files and\n"
+	"             elapsed time to STDERR after the scan.\n"
+	"\n"
 	"  -v         Report all affected mapped files.\n"
 	"\n"
-	"  -h         Show this message and exit.\n"
+	"  -h, --help\n"
+	"             Show this message and exit.\n"
 	"\n"
-	"  -V         Print program version and exit.\n"
+	"  -V, --version\n"
+	"             Print program version and exit.\n"
 	"\n"
 	"Please report bugs at <https://github.com/jirutka/apk-autoupdate/issues>\n";
 
+static const struct option LONG_OPTS[] = {
+	{ "by-file",       no_argument,       NULL, 'b' },
+	{ "cgroup",        required_argument, NULL, 'c' },
+	{ "cost",          no_argument,       NULL, 'm' },
+	{ "deadline",      required_argument, NULL, 'D' },
+	{ "deleted-fds",   no_argument,       NULL, 'd' },
+	{ "exe",           required_argument, NULL, 'e' },
+	{ "fast",          no_argument,       NULL, 'F' },
+	{ "format",        required_argument, NULL, 'o' },
+	{ "fs-policy",     required_argument, NULL, 'P' },
+	{ "group",         no_argument,       NULL, 'g' },
+	{ "help",          no_argument,       NULL, 'h' },
+	{ "jobs",          required_argument, NULL, 'j' },
+	{ "max-iops",      required_argument, NULL, 'I' },
+	{ "max-pressure",  required_argument, NULL, 'L' },
+	{ "max-read-rate", required_argument, NULL, 'R' },
+	{ "quiet",         no_argument,       NULL, 'q' },
+	{ "serve",         no_argument,       NULL, 'S' },
+	{ "timeout",       required_argument, NULL, 'T' },
+	{ "timing",        no_argument,       NULL, 't' },
+	{ "tree",          required_argument, NULL, 'p' },
+	{ "uid",           required_argument, NULL, 'u' },
+	{ "version",       no_argument,       NULL, 'V' },
+	{ NULL,            0,                 NULL, 0   },
+};
+
 static unsigned int flags = 0;
 
+// Identity of a file.
+struct file_id {
+	dev_t dev;
+	ino_t ino;
+};
+
+// Growable array of PIDs terminated by -1.
+struct pid_list {
+	pid_t *items;
+	size_t cnt;
+	size_t size;
+};
+
+// Parent link of a process.
+struct proc_link {
+	pid_t pid;
+	pid_t ppid;
+};
+
+// Selection of processes to scan; the arrays are terminated by NULL or -1.
+static struct {
+	const char **cgroups;
+	const char **exe_patterns;
+	pid_t *trees;
+	uid_t *uids;
+	// PIDs read from *cgroups* and *trees*, sorted; items is NULL if
+	// neither is specified.
+	struct pid_list pids;
+} selection;
+
+// Memory used by stale mappings (in kB).
+struct mem_cost {
+	unsigned long rss;
+	unsigned long pss;
+};
+
+// Memory used by stale mappings of a file.
+struct file_cost {
+	char *path;
+	struct mem_cost cost;
+};
+
+// Memory used by stale mappings of the last reported process (FLAG_COST).
+static struct {
+	pid_t pid;
+	const struct candidate *candidates;  // candidates of the process
+	size_t candidates_cnt;
+	struct file_cost *files;
+	size_t files_cnt;
+	struct mem_cost total;
+} cost;
+
+// Record of the report, i.e. one line of the output.
+struct record {
+	pid_t pid;
+	int reason;            // REASON_*
+	const char *filename;  // the stale file, or NULL
+	struct file_id file;   // identity of the stale file, or { 0, 0 }
+	off_t size;            // size of the stale file, or -1
+	bool suspected;
+	bool unknown;          // the comparison has timed out
+	unsigned int procs;    // number of processes in the group, or 0
+	const struct mem_cost *mem;
+	const struct pid_list *pids;  // processes that use the file (FLAG_BY_FILE)
+};
+
+// Replaced file used by a group of processes.
+struct group_file {
+	char *path;
+	pid_t last_pid;
+	int reason;
+	struct file_id file;
+	off_t size;
+	bool suspected;
+	bool unknown;
+	struct mem_cost mem;
+};
+
+// Affected processes collapsed into their top-most ancestor with the same
+// executable and session (FLAG_GROUP).
+struct proc_group {
+	pid_t leader;
+	pid_t last_pid;
+	unsigned int procs;
+	int reason;  // reason of the first report, or -1
+	off_t size;  // total size of deleted files held open (REASON_FD)
+	bool suspected;
+	bool unknown;
+	struct mem_cost mem;
+	struct group_file *files;
+	size_t files_cnt;
+};
+
+// Executable and command line of the last printed process (FLAG_JSON and
+// FLAG_NUL).
+static struct {
+	pid_t pid;
+	char exe[PATH_MAX];
+	char *cmdline;
+	size_t cmdline_size;
+} proc_info = { .pid = -1 };
+
+// Groups of the current scan in order of the first report.
+static struct {
+	struct proc_group *items;
+	size_t cnt;
+	size_t size;
+} groups;
+
+// Counters of the current scan, reported with FLAG_TIMING.
+static struct {
+	unsigned long procs;
+	unsigned long files_compared;
+	unsigned long files_cached;
+	struct mem_cost stale;
+	off_t deleted_size;
+	double throttled;  // seconds
+	unsigned long files_unknown;
+} stats;
+
 // Struct for storing selected fields from /proc/<pid>/maps entries.
 struct map_info {
 	ptrdiff_t start;
 	ptrdiff_t end;
 	unsigned int dev_major;
+	unsigned int dev_minor;
 	unsigned long inode;
 	char filename[PATH_MAX + 8];  // we need +1 for \0, but use 8 for better align
 };
 
+// Entry of a cache, keyed by identities of up to three files and optionally
+// by a file name.
+struct cache_entry {
+	struct cache_entry *next;
+	struct file_id key[3];
+	char *name;
+};
+
+// Hash table of cache entries (struct cache_entry is the first member of
+// the actual entry).
+struct cache {
+	struct cache_entry **buckets;
+	size_t size;
+	size_t count;
+};
+
+// Cached result of comparison of a mapped (deleted) file with the file
+// currently on disk; key is { mapped, disk }. The disk file is identified also
+// by its size and mtime, so the entry is not reused when the file is
+// modified in place.
+struct verdict {
+	struct cache_entry entry;
+	off_t disk_size;
+	struct timespec disk_mtime;
+	int result;
+};
+
+// Comparison of a mapped file with the file on disk queued in the collect
+// phase of a scan; key is { mapped, disk }, so each pair is compared only
+// once, no matter how many processes use it.
+struct cmp_job {
+	struct cache_entry entry;
+	char *disk_path;  // as seen by the first process that queued it
+	char *mapped_path;
+	struct stat disk_sb;
+	int result;  // CMP_PENDING until resolved
+};
+
+// Result of comparison of a mapped file in a mount namespace; key is
+// { mapped, mount namespace, root directory }, name is the file path.
+struct ns_verdict {
+	struct cache_entry entry;
+	struct cmp_job *job;  // comparison to wait for, or NULL
+	int result;
+};
+
+// Deleted (or replaced) file mapped by a process, collected in the first
+// phase of a scan and reported in the last one.
+struct candidate {
+	pid_t pid;
+	int reason;
+	char *filename;
+	struct file_id mapped;
+	off_t size;
+	struct cmp_job *job;  // comparison to wait for, or NULL
+	int result;  // result of the comparison if job is NULL
+	char *mapped_path;  // for a retry of the job, or NULL
+};
+
+// Verdicts are kept for the whole lifetime of the process, so in the serve
+// mode they stay warm between requests.
+static struct cache verdicts = { NULL, 0, 0 };
+
+// Namespace verdicts skip even stat of the file on disk, so they are valid
+// only during a single scan.
+static struct cache ns_verdicts = { NULL, 0, 0 };
+
+// Deleted files held open by the scanned processes; key is { file, { 0, pid } }
+// for each process and { file } for the total. It's valid only during
+// a single scan.
+static struct cache deleted_fds = { NULL, 0, 0 };
+
+// Stale file and processes that use it (FLAG_BY_FILE); key is { file },
+// name is the path.
+struct stale_file {
+	struct cache_entry entry;
+	int reason;
+	off_t size;
+	bool suspected;
+	bool unknown;
+	pid_t last_pid;  // last process (not group leader) counted in mem
+	size_t index;    // index in by_file.items
+	struct mem_cost mem;
+	struct pid_list pids;
+};
+
+// Index of stale files of the current scan; the array keeps them in order
+// of the first report.
+static struct {
+	struct cache cache;
+	struct stale_file **items;
+	size_t cnt;
+	size_t size;
+	// Group leaders already listed in pids of the files (FLAG_GROUP); key is
+	// { file, { 0, leader }, { 0, index } }.
+	struct cache leaders;
+	pid_t last_pid;
+	pid_t last_leader;  // group leader of last_pid
+} by_file = { .last_pid = -1, .last_leader = -1 };
+
+// Pipeline of the current scan: scanned processes and candidates in order of
+// collection, and comparisons queued for the resolve phase.
+static struct {
+	struct pid_list procs;
+	struct candidate *candidates;
+	size_t candidates_cnt;
+	size_t candidates_size;
+	struct cache jobs_cache;
+	struct cmp_job **jobs;
+	size_t jobs_cnt;
+	size_t jobs_size;
+	atomic_size_t next_job;
+	atomic_bool stop;
+} pipeline;
+
+// Maximal number of comparisons resolved in parallel.
+static unsigned int workers_max = 1;
+
+// Limits of duration of a scan in seconds, or 0 if not limited.
+static struct {
+	double deadline;  // for the whole scan
+	double timeout;   // for comparison of one file
+	struct timespec start;
+} limits;
+
+// Token buckets pacing reads of the compared files and procfs maps, shared
+// by all workers. The tokens may go negative, then the caller waits until
+// the debt is refilled.
+static struct {
+	pthread_mutex_t lock;
+	double bytes_rate;  // bytes per second, or 0 if not limited
+	double ops_rate;    // operations per second, or 0 if not limited
+	double bytes;
+	double ops;
+	struct timespec last;
+	bool remote;  // request the tokens from the parent (in the helper)
+} throttle = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static const char *PRESSURE_NAMES[] = { "cpu", "io", "memory", NULL };
+
+// Thresholds of pressure stall information ("some avg10", in percent) of the
+// system and the cgroup of this process, above which the reads paced by the
+// throttle are paused; 0 if not limited. It's guarded by throttle.lock.
+static struct {
+	bool enabled;
+	double max[3];  // in order of PRESSURE_NAMES
+	char cgroup_dir[PATH_MAX];  // empty if unknown
+	struct timespec checked;
+} pressure;
+
+static const char *FS_POLICY_NAMES[] = { "compare", "changed", "unchanged", "skip", NULL };
+
+// Policy for mapped files on filesystem of the type (-P).
+struct fs_policy {
+	const char *type;  // not terminated, see type_len
+	size_t type_len;
+	int policy;
+};
+
+// Policies given by the user; the last one given for a type wins.
+static struct {
+	struct fs_policy *items;
+	size_t cnt;
+} fs_policies;
+
+// Type of the filesystem of a device as in the mount table; key is
+// { { dev, 0 } }. It's valid only during a single scan.
+struct fs_type {
+	struct cache_entry entry;
+	char name[32];  // empty if the device is not a filesystem with files
+};
+
+static struct cache fs_types = { NULL, 0, 0 };
+
+// Identity of the mount namespace and root directory of a process.
+struct proc_ns {
+	bool loaded;
+	bool valid;
+	struct file_id mnt;
+	struct file_id root;
+};
+
 
 __attribute__((format(printf, 3, 4)))
 static void str_fmt (char *buf, size_t buf_size, const char *format, ...) {
@@ -168,11 +697,535 @@ static bool fnmatch_any (const char **patterns, const char *string, int flags) {
 	return false;
 }
 
+static double elapsed_since (const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Returns number of seconds left until the deadline of the current scan (0
+// if it has passed), or -1 if there's no deadline.
+static double deadline_left (void) {
+	if (limits.deadline <= 0) {
+		return -1;
+	}
+	double left = limits.deadline - elapsed_since(&limits.start);
+
+	return left > 0 ? left : 0;
+}
+
+// Returns the "some avg10" value from the pressure file *path*, or -1 if it
+// could not be read (e.g. the kernel is built without PSI).
+static double pressure_read (const char *path) {
+	FILE *fp = fopen(path, "r");
+	double avg10 = -1;
+
+	if (fp) {
+		if (fscanf(fp, "some avg10=%lf", &avg10) != 1) {
+			avg10 = -1;
+		}
+		fclose(fp);
+	}
+	return avg10;
+}
+
+// Returns true if pressure of any resource is above its threshold.
+static bool pressure_exceeded (void) {
+	char path[PATH_MAX + 32];
+
+	for (size_t i = 0; PRESSURE_NAMES[i]; i++) {
+		if (pressure.max[i] <= 0) {
+			continue;
+		}
+		str_fmt(path, sizeof(path), PRESSURE_PATH, PRESSURE_NAMES[i]);
+		if (pressure_read(path) > pressure.max[i]) {
+			return true;
+		}
+		if (pressure.cgroup_dir[0] != '\0') {
+			str_fmt(path, sizeof(path), "%s/%s.pressure", pressure.cgroup_dir, PRESSURE_NAMES[i]);
+			if (pressure_read(path) > pressure.max[i]) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+// Finds the cgroup (v2) directory of this process for pressure_exceeded().
+static void pressure_init (void) {
+	FILE *fp = fopen(PROC_SELF_CGROUP_PATH, "r");
+	char line[PATH_MAX];
+
+	if (!fp) {
+		return;
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "0::/", 4) == 0) {
+			(void) str_chomp(line, "\n");
+			// The root cgroup has no pressure files, the system ones apply.
+			if (line[4] != '\0') {
+				str_fmt(pressure.cgroup_dir, sizeof(pressure.cgroup_dir), "%s%s",
+				        CGROUP_ROOT_PATH, line + 3);
+			}
+			break;
+		}
+	}
+	fclose(fp);
+}
+
+// Waits until the pressure is below the thresholds, or the deadline. It's
+// checked at most once per PRESSURE_CHECK_INTERVAL. Must be called with
+// throttle.lock held, so all workers pause together. Returns the time
+// waited in seconds.
+static double pressure_wait (void) {
+	struct timespec start;
+	double waited = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (elapsed_since(&pressure.checked) >= PRESSURE_CHECK_INTERVAL
+			&& deadline_left() != 0) {
+		clock_gettime(CLOCK_MONOTONIC, &pressure.checked);
+
+		if (!pressure_exceeded()) {
+			break;
+		}
+		struct timespec ts = { PRESSURE_CHECK_INTERVAL, 0 };
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+
+		waited = elapsed_since(&start);
+	}
+	return waited;
+}
+
+// Takes *bytes* and *ops* from the throttle's buckets, and waits if there
+// are not enough tokens. The buckets hold at most one second worth of tokens.
+static void throttle_acquire (size_t bytes, unsigned int ops) {
+	struct timespec now;
+	double wait = 0;
+
+	// See cmp_files_timed().
+	if (throttle.remote) {
+		char c;
+		ssize_t n;
+
+		fprintf(stderr, "%cT%zu %u\n", '\0', bytes, ops);
+		while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+		if (n <= 0) {
+			_exit(EXIT_FAILURE);  // the parent has given up
+		}
+		return;
+	}
+	if (throttle.bytes_rate <= 0 && throttle.ops_rate <= 0 && !pressure.enabled) {
+		return;
+	}
+	pthread_mutex_lock(&throttle.lock);
+	{
+		if (pressure.enabled) {
+			stats.throttled += pressure_wait();
+		}
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		double elapsed = (double)(now.tv_sec - throttle.last.tv_sec)
+		               + (double)(now.tv_nsec - throttle.last.tv_nsec) / 1e9;
+		throttle.last = now;
+
+		if (throttle.bytes_rate > 0) {
+			throttle.bytes += elapsed * throttle.bytes_rate;
+			if (throttle.bytes > throttle.bytes_rate) {
+				throttle.bytes = throttle.bytes_rate;
+			}
+			throttle.bytes -= (double) bytes;
+			if (throttle.bytes < 0 && -throttle.bytes / throttle.bytes_rate > wait) {
+				wait = -throttle.bytes / throttle.bytes_rate;
+			}
+		}
+		if (throttle.ops_rate > 0) {
+			throttle.ops += elapsed * throttle.ops_rate;
+			if (throttle.ops > throttle.ops_rate) {
+				throttle.ops = throttle.ops_rate;
+			}
+			throttle.ops -= ops;
+			if (throttle.ops < 0 && -throttle.ops / throttle.ops_rate > wait) {
+				wait = -throttle.ops / throttle.ops_rate;
+			}
+		}
+		// Nothing is paced after the deadline, the scan should just finish.
+		double left = deadline_left();
+		if (left >= 0 && wait > left) {
+			wait = left;
+		}
+		stats.throttled += wait;
+	}
+	pthread_mutex_unlock(&throttle.lock);
+
+	if (wait > 0) {
+		struct timespec ts = { (time_t) wait, (long)((wait - (double)(time_t) wait) * 1e9) };
+		while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+	}
+}
+
+// Paces reading of *len* bytes from *offset* of both compared files. Each
+// started THROTTLE_STEP_SIZE of a file counts as one operation, regardless of
+// the size of the reads.
+static void throttle_read (size_t offset, size_t len) {
+	size_t steps = (offset + len + THROTTLE_STEP_SIZE - 1) / THROTTLE_STEP_SIZE
+	             - (offset + THROTTLE_STEP_SIZE - 1) / THROTTLE_STEP_SIZE;
+
+	throttle_acquire(2 * len, 2 * (unsigned int) steps);
+}
+
+#ifdef WITH_IO_URING
+
+// Minimal io_uring instance with a pool of buffers for reading chunks of the
+// compared files (without liburing).
+struct uring {
+	int fd;  // -1 if not initialized, -2 if io_uring is not available
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	size_t sqes_size;
+	char *bufs;  // URING_DEPTH pairs of chunks
+};
+
+// Each comparison worker has its own ring.
+static _Thread_local struct uring uring = { .fd = -1 };
+
+static void uring_free (void) {
+	if (uring.fd < 0) {
+		return;
+	}
+	if (uring.sqes) (void) munmap(uring.sqes, uring.sqes_size);
+	if (uring.cq_ptr && uring.cq_ptr != uring.sq_ptr) (void) munmap(uring.cq_ptr, uring.cq_size);
+	if (uring.sq_ptr) (void) munmap(uring.sq_ptr, uring.sq_size);
+	free(uring.bufs);
+	(void) close(uring.fd);
+
+	uring = (struct uring) { .fd = -1 };
+}
+
+// Sets up the ring, unless already done. Returns false if io_uring is not
+// available (e.g. old kernel, or disabled by sysctl or seccomp).
+static bool uring_init (void) {
+	struct io_uring_params params;
+
+	if (uring.fd != -1) {
+		return uring.fd >= 0;
+	}
+	memset(&params, 0, sizeof(params));
+
+	if ((uring.fd = (int) syscall(__NR_io_uring_setup, URING_DEPTH * 2, &params)) < 0) {
+		uring.fd = -2;
+		return false;
+	}
+	uring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	uring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	uring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP && uring.cq_size > uring.sq_size) {
+		uring.sq_size = uring.cq_size;
+	}
+	uring.sq_ptr = mmap(NULL, uring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                    uring.fd, IORING_OFF_SQ_RING);
+	if (uring.sq_ptr == MAP_FAILED) {
+		uring.sq_ptr = NULL;
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		uring.cq_ptr = uring.sq_ptr;
+	} else {
+		uring.cq_ptr = mmap(NULL, uring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		                    uring.fd, IORING_OFF_CQ_RING);
+		if (uring.cq_ptr == MAP_FAILED) {
+			uring.cq_ptr = NULL;
+			goto fail;
+		}
+	}
+	uring.sqes = mmap(NULL, uring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	                  uring.fd, IORING_OFF_SQES);
+	if (uring.sqes == MAP_FAILED) {
+		uring.sqes = NULL;
+		goto fail;
+	}
+	if (!(uring.bufs = malloc(URING_DEPTH * 2 * URING_CHUNK_SIZE))) {
+		goto fail;
+	}
+	char *sq = uring.sq_ptr, *cq = uring.cq_ptr;
+
+	uring.sq_tail = (unsigned int *)(void *)(sq + params.sq_off.tail);
+	uring.sq_mask = (unsigned int *)(void *)(sq + params.sq_off.ring_mask);
+	uring.sq_array = (unsigned int *)(void *)(sq + params.sq_off.array);
+	uring.cq_head = (unsigned int *)(void *)(cq + params.cq_off.head);
+	uring.cq_tail = (unsigned int *)(void *)(cq + params.cq_off.tail);
+	uring.cq_mask = (unsigned int *)(void *)(cq + params.cq_off.ring_mask);
+	uring.cqes = (struct io_uring_cqe *)(void *)(cq + params.cq_off.cqes);
+
+	return true;
+
+fail:
+	uring_free();
+	uring.fd = -2;
+	return false;
+}
+
+// Queues read of *len* bytes at *offset* of the file *fd* into *buf*.
+static void uring_prep_read (int fd, char *buf, unsigned int len, off_t offset, uint64_t data) {
+	unsigned int tail = *uring.sq_tail;  // only we write it
+	unsigned int idx = tail & *uring.sq_mask;
+	struct io_uring_sqe *sqe = &uring.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t) buf;
+	sqe->len = len;
+	sqe->off = (uint64_t) offset;
+	sqe->user_data = data;
+
+	uring.sq_array[idx] = idx;
+	__atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Compares contents of the files *fd1* and *fd2* of the same *size* using
+// io_uring: chunks of both files are read asynchronously, up to URING_DEPTH
+// chunks at once, and compared as soon as both halves arrive. Returns 0 if
+// the files are identical, 1 if not, and RET_ERROR if the comparison could
+// not be done this way (then the caller should fall back to mmap).
+static int cmp_fds_uring (int fd1, int fd2, size_t size) {
+	unsigned int arrived[URING_DEPTH] = { 0 };
+	unsigned int free_slots[URING_DEPTH];
+	size_t free_cnt = URING_DEPTH;
+	size_t chunks = (size + URING_CHUNK_SIZE - 1) / URING_CHUNK_SIZE;
+	size_t slot_chunk[URING_DEPTH];
+	size_t next_chunk = 0;
+	unsigned int to_submit = 0, inflight = 0;
+	bool stop = false;
+	int res = 0;
+
+	if (!uring_init()) {
+		return RET_ERROR;
+	}
+	for (unsigned int i = 0; i < URING_DEPTH; i++) {
+		free_slots[i] = i;
+	}
+
+	while (true) {
+		// Fill free slots with reads of the next chunks of both files.
+		while (!stop && next_chunk < chunks && free_cnt > 0) {
+			unsigned int slot = free_slots[--free_cnt];
+			off_t offset = (off_t)(next_chunk * URING_CHUNK_SIZE);
+			unsigned int len = (unsigned int)(size - next_chunk * URING_CHUNK_SIZE < URING_CHUNK_SIZE
+				? size - next_chunk * URING_CHUNK_SIZE : URING_CHUNK_SIZE);
+			char *buf = uring.bufs + (size_t) slot * 2 * URING_CHUNK_SIZE;
+
+			throttle_read((size_t) offset, len);
+
+			slot_chunk[slot] = next_chunk++;
+			arrived[slot] = 0;
+			uring_prep_read(fd1, buf, len, offset, slot * 2);
+			uring_prep_read(fd2, buf + URING_CHUNK_SIZE, len, offset, slot * 2 + 1);
+			to_submit += 2;
+			inflight += 2;
+		}
+		if (inflight == 0) {
+			break;
+		}
+		// The kernel may consume only some of the SQEs, so wait for
+		// a completion only if there are reads already submitted.
+		unsigned int submitted = inflight - to_submit;
+		long ret = syscall(__NR_io_uring_enter, uring.fd, to_submit, submitted > 0 ? 1 : 0,
+		                   submitted > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0 || (ret == 0 && submitted == 0)) {
+			// The ring is in unknown state now, so don't use it anymore.
+			uring_free();
+			uring.fd = -2;
+			return RET_ERROR;
+		}
+		to_submit -= (unsigned int) ret;
+
+		unsigned int head = *uring.cq_head;
+		unsigned int tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &uring.cqes[head & *uring.cq_mask];
+			unsigned int slot = (unsigned int)(cqe->user_data / 2);
+			size_t chunk = slot_chunk[slot];
+			size_t len = size - chunk * URING_CHUNK_SIZE < URING_CHUNK_SIZE
+				? size - chunk * URING_CHUNK_SIZE : URING_CHUNK_SIZE;
+
+			inflight--;
+
+			// Short reads and errors are left to the synchronous path.
+			if (cqe->res < 0 || (size_t) cqe->res != len) {
+				res = RET_ERROR;
+				stop = true;
+			}
+			if (++arrived[slot] < 2) {
+				continue;
+			}
+			char *buf = uring.bufs + (size_t) slot * 2 * URING_CHUNK_SIZE;
+
+			if (!stop && memcmp(buf, buf + URING_CHUNK_SIZE, len) != 0) {
+				res = 1;  // files are different
+				stop = true;
+			}
+			free_slots[free_cnt++] = slot;
+		}
+		__atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+	}
+	return res;
+}
+
+#endif  // WITH_IO_URING
+
+// Pages of a file that were in the page cache before the comparison.
+struct residency {
+	unsigned char *vec;  // one byte per page, or NULL if unknown
+	size_t pages;
+};
+
+// Takes snapshot of pages of the file *fd* (described by *sb*) that are in
+// the page cache. It's known only if we are root or owner of the file,
+// otherwise mincore(2) reports just pages mapped by us.
+static void residency_load (int fd, const struct stat *sb, struct residency *r) {
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+	size_t size = (size_t) sb->st_size;
+
+	*r = (struct residency) { NULL, 0 };
+
+	if (size == 0 || (geteuid() != 0 && sb->st_uid != geteuid())) {
+		return;
+	}
+	r->pages = (size + page_size - 1) / page_size;
+	if (!(r->vec = malloc(r->pages))) {
+		return;
+	}
+	// The file is mapped by windows, so it doesn't exhaust address space.
+	for (size_t offset = 0; offset < size; offset += CMP_WINDOW_SIZE) {
+		size_t len = size - offset < CMP_WINDOW_SIZE ? size - offset : CMP_WINDOW_SIZE;
+
+		void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, (off_t) offset);
+		if (addr == MAP_FAILED) {
+			goto fail;
+		}
+		int rc = mincore(addr, len, r->vec + offset / page_size);
+		(void) munmap(addr, len);
+
+		if (rc < 0) {
+			goto fail;
+		}
+	}
+	return;
+
+fail:
+	free(r->vec);
+	r->vec = NULL;
+}
+
+// Drops pages in the range *offset* to *offset* + *len* of the file *fd* from
+// the page cache, unless they have been there before the comparison.
+static void residency_restore (int fd, const struct residency *r, size_t offset, size_t len) {
+	size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+	if (!r->vec) {
+		return;
+	}
+	size_t end = (offset + len + page_size - 1) / page_size;
+
+	for (size_t i = offset / page_size; i < end && i < r->pages; ) {
+		if (r->vec[i] & 1) {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while (i < end && i < r->pages && !(r->vec[i] & 1)) {
+			i++;
+		}
+		(void) posix_fadvise(fd, (off_t)(start * page_size), (off_t)((i - start) * page_size),
+		                     POSIX_FADV_DONTNEED);
+	}
+}
+
+// Reads *len* bytes at *offset* of the file *fd* into *buf*. Returns number
+// of bytes read (less than *len* only at the end of file), or -1 on error.
+static ssize_t pread_full (int fd, char *buf, size_t len, off_t offset) {
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = pread(fd, buf + done, len - done, offset + (off_t) done);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n < 0) {
+			return -1;
+		} else if (n == 0) {
+			break;
+		}
+		done += (size_t) n;
+	}
+	return (ssize_t) done;
+}
+
+// Compares contents of the files *fd1* and *fd2* of the same *size* from
+// *offset* to the end by reading them into a fixed pair of buffers, so the
+// memory use doesn't depend on the size. See cmp_files().
+static int cmp_fds_read (int fd1, int fd2, size_t offset, size_t size,
+                         const struct residency *cached1, const struct residency *cached2) {
+	int res = 0;
+	char *buf1 = malloc(CMP_BUFFER_SIZE);
+	char *buf2 = malloc(CMP_BUFFER_SIZE);
+
+	if (!buf1 || !buf2) {
+		res = RET_ERROR;
+		goto done;
+	}
+	for (; offset < size && res == 0; offset += CMP_BUFFER_SIZE) {
+		size_t len = size - offset < CMP_BUFFER_SIZE ? size - offset : CMP_BUFFER_SIZE;
+
+		throttle_read(offset, len);
+
+		ssize_t n1 = pread_full(fd1, buf1, len, (off_t) offset);
+		ssize_t n2 = pread_full(fd2, buf2, len, (off_t) offset);
+
+		if (n1 < 0 || n2 < 0) {
+			res = RET_ERROR;
+		} else if (n1 != n2 || memcmp(buf1, buf2, (size_t) n1) != 0) {
+			res = 1;  // files are different
+		}
+		residency_restore(fd1, cached1, offset, len);
+		residency_restore(fd2, cached2, offset, len);
+	}
+
+done:
+	free(buf1);
+	free(buf2);
+
+	return res;
+}
+
+// Compares contents of the files *fname1* and *fname2*. Returns 0 if they are
+// identical, 1 if not, and RET_ERROR on error. The files are read
+// sequentially, one window at a time, and pages that were not cached before
+// are dropped from the page cache after each window, so the comparison
+// doesn't evict hot data of other processes. Large files, or when address
+// space is exhausted, are read into buffers instead of being mapped.
 static int cmp_files (const char *fname1, const char *fname2) {
 	int res = RET_ERROR;
 
 	int fd1 = -1, fd2 = -1;
-	char *addr1 = NULL, *addr2 = NULL;
+	struct residency cached1 = { NULL, 0 }, cached2 = { NULL, 0 };
 	size_t size = 0;
 
 	if ((fd1 = open(fname1, O_RDONLY)) < 0) {
@@ -192,78 +1245,1546 @@ static int cmp_files (const char *fname1, const char *fname2) {
 			goto done;
 		}
 		size = (size_t) sb1.st_size;
+
+		residency_load(fd1, &sb1, &cached1);
+		residency_load(fd2, &sb2, &cached2);
 	}
+	(void) posix_fadvise(fd1, 0, 0, POSIX_FADV_SEQUENTIAL);
+	(void) posix_fadvise(fd2, 0, 0, POSIX_FADV_SEQUENTIAL);
 
-	if ((addr1 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd1, 0)) == MAP_FAILED) {
-		log_err("%s: %s", fname1, strerror(errno));
+#ifdef WITH_IO_URING
+	if ((res = cmp_fds_uring(fd1, fd2, size)) != RET_ERROR) {
+		residency_restore(fd1, &cached1, 0, size);
+		residency_restore(fd2, &cached2, 0, size);
 		goto done;
 	}
-	if ((addr2 = mmap(NULL, size, PROT_READ, MAP_SHARED, fd2, 0)) == MAP_FAILED) {
-		log_err("%s: %s", fname2, strerror(errno));
+#endif
+
+	if (size > CMP_MMAP_MAX_SIZE) {
+		res = cmp_fds_read(fd1, fd2, 0, size, &cached1, &cached2);
 		goto done;
 	}
+	res = 0;
+	for (size_t offset = 0; offset < size && res == 0; offset += CMP_WINDOW_SIZE) {
+		size_t len = size - offset < CMP_WINDOW_SIZE ? size - offset : CMP_WINDOW_SIZE;
+		char *addr1, *addr2 = MAP_FAILED;
+
+		if ((addr1 = mmap(NULL, len, PROT_READ, MAP_SHARED, fd1, (off_t) offset)) == MAP_FAILED
+				|| (addr2 = mmap(NULL, len, PROT_READ, MAP_SHARED, fd2, (off_t) offset)) == MAP_FAILED) {
+			int mmap_err = errno;
+
+			if (addr1 != MAP_FAILED) {
+				(void) munmap(addr1, len);
+			}
+			// Out of address space, read the rest into buffers.
+			if (mmap_err == ENOMEM) {
+				res = cmp_fds_read(fd1, fd2, offset, size, &cached1, &cached2);
+			} else {
+				log_err("%s: %s", addr1 == MAP_FAILED ? fname1 : fname2, strerror(mmap_err));
+				res = RET_ERROR;
+			}
+			break;
+		}
+		for (size_t pos = 0; pos < len && res == 0; pos += THROTTLE_STEP_SIZE) {
+			size_t n = len - pos < THROTTLE_STEP_SIZE ? len - pos : THROTTLE_STEP_SIZE;
+
+			throttle_read(offset + pos, n);
+			if (memcmp(addr1 + pos, addr2 + pos, n) != 0) {
+				res = 1;  // files are different
+			}
+		}
+		(void) munmap(addr1, len);
+		(void) munmap(addr2, len);
 
-	res = memcmp(addr1, addr2, size) == 0 ? 0 : 1;
+		residency_restore(fd1, &cached1, offset, len);
+		residency_restore(fd2, &cached2, offset, len);
+	}
 
 done:
-	if (addr1) (void) munmap(addr1, size);
-	if (addr2) (void) munmap(addr2, size);
+	free(cached1.vec);
+	free(cached2.vec);
 	if (fd1 > 0) (void) close(fd1);
 	if (fd2 > 0) (void) close(fd2);
 
 	return res;
 }
 
-static pid_t next_pid (DIR *proc_dir) {
+// Runs cmp_files() for *job* in a helper process (this program executed
+// again), so it can be killed if it doesn't finish in time (e.g. it's stuck on
+// a hung NFS or FUSE mount). A plain fork() is not safe here, since the child
+// of a multithreaded process may deadlock in malloc() or stdio. Returns the
+// result, or CMP_UNKNOWN on timeout.
+//
+// The helper must not hold our stdout or stderr open, since it may outlive
+// us. It writes its error messages to a socket shared by its stdin and
+// stderr, interleaved with lines starting with NUL: "T<bytes> <ops>" requests
+// tokens of the throttle and waits for a byte in reply, "R<result>" is the
+// result. The time spent waiting for the tokens is not counted in the
+// timeout, but it's bounded by the deadline.
+static int cmp_files_timed (const struct cmp_job *job) {
+	double timeout = limits.timeout;
+	int sv[2];
+
+	if (deadline_left() == 0) {
+		return CMP_UNKNOWN;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+		log_err("socketpair: %s", strerror(errno));
+		return RET_ERROR;
+	}
+	bool paced = throttle.bytes_rate > 0 || throttle.ops_rate > 0 || pressure.enabled;
+	char *const argv[] = {
+		(char *) PROGNAME, (char *) CMP_HELPER_ARG, (char *)(paced ? "1" : "0"),
+		job->disk_path, job->mapped_path, NULL
+	};
+	posix_spawn_file_actions_t actions;
+	pid_t pid;
+
+	(void) posix_spawn_file_actions_init(&actions);
+	(void) posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+	(void) posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	(void) posix_spawn_file_actions_adddup2(&actions, sv[1], STDERR_FILENO);
+
+	int err = posix_spawn(&pid, PROC_SELF_EXE_PATH, &actions, NULL, argv, environ);
+	(void) posix_spawn_file_actions_destroy(&actions);
+	(void) close(sv[1]);
+
+	if (err != 0) {
+		log_err("%s: %s", PROC_SELF_EXE_PATH, strerror(err));
+		(void) close(sv[0]);
+		return RET_ERROR;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	double paused = 0;  // time spent waiting for the throttle
+	int res = CMP_UNKNOWN;
+	bool done = false;
+	char buf[512];
+	size_t len = 0;
+
+	while (!done) {
+		double remaining = -1;  // not limited
+
+		if (timeout > 0) {
+			remaining = timeout - (elapsed_since(&start) - paused);
+			if (remaining < 0) remaining = 0;
+		}
+		double left = deadline_left();
+		if (left >= 0 && (remaining < 0 || left < remaining)) {
+			remaining = left;
+		}
+		if (remaining == 0) {
+			break;
+		}
+		struct pollfd pfd = { .fd = sv[0], .events = POLLIN };
+		int rc = poll(&pfd, 1, remaining < 0 ? -1 : (int)(remaining * 1000) + 1);
+
+		if (rc < 0 && errno == EINTR) {
+			continue;
+		} else if (rc < 0) {
+			break;
+		} else if (rc == 0) {
+			continue;  // recheck the time
+		}
+		ssize_t n = read(sv[0], buf + len, sizeof(buf) - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			res = RET_ERROR;  // the helper has died without result
+			break;
+		}
+		len += (size_t) n;
+
+		char *line = buf, *end;
+		while (!done && (end = memchr(line, '\n', len - (size_t)(line - buf)))) {
+			*end = '\0';
+
+			if (line[0] != '\0') {
+				// Pass through error messages of the helper.
+				fprintf(stderr, "%s\n", line);
+
+			} else if (line[1] == 'T') {
+				size_t bytes;
+				unsigned int ops;
+
+				if (sscanf(line + 2, "%zu %u", &bytes, &ops) == 2) {
+					struct timespec t;
+					clock_gettime(CLOCK_MONOTONIC, &t);
+					throttle_acquire(bytes, ops);
+					paused += elapsed_since(&t);
+				}
+				done = deadline_left() == 0 || send(sv[0], "", 1, MSG_NOSIGNAL) < 0;
+
+			} else if (line[1] == 'R') {
+				res = (int) strtol(line + 2, NULL, 10);
+				done = true;
+			}
+			line = end + 1;
+		}
+		len -= (size_t)(line - buf);
+		memmove(buf, line, len);
+
+		// A message too long to fit, pass it through as is.
+		if (len == sizeof(buf)) {
+			fwrite(buf, 1, len, stderr);
+			len = 0;
+		}
+	}
+	(void) close(sv[0]);
+
+	if (res == CMP_UNKNOWN) {
+		(void) kill(pid, SIGKILL);
+		// It may be stuck in uninterruptible sleep, it's reaped later.
+		(void) waitpid(pid, NULL, WNOHANG);
+	} else {
+		(void) waitpid(pid, NULL, 0);
+	}
+	return res;
+}
+
+// Entry point of the helper process of cmp_files_timed(); *paced* is "1" if
+// the reads should be paced by the throttle of the parent.
+static int cmp_helper (const char *paced, const char *disk_path, const char *mapped_path) {
+	throttle.remote = strcmp(paced, "1") == 0;
+
+	int res = cmp_files(disk_path, mapped_path);
+	fprintf(stderr, "%cR%d\n", '\0', res);
+
+	return EXIT_SUCCESS;
+}
+
+static bool file_id_eq (struct file_id a, struct file_id b) {
+	return a.dev == b.dev && a.ino == b.ino;
+}
+
+static size_t cache_hash (const struct file_id key[3], const char *name) {
+	size_t h = 0;
+
+	for (size_t i = 0; i < 3; i++) {
+		h = h * 31 + (size_t) key[i].dev;
+		h = h * 31 + (size_t) key[i].ino;
+	}
+	for (; name && *name; name++) {
+		h = h * 31 + (unsigned char) *name;
+	}
+	return h ^ (h >> 16);
+}
+
+static struct cache_entry *cache_get (struct cache *cache, const struct file_id key[3],
+                                      const char *name) {
+	if (cache->size == 0) {
+		return NULL;
+	}
+	struct cache_entry *e = cache->buckets[cache_hash(key, name) % cache->size];
+
+	for (; e; e = e->next) {
+		if (file_id_eq(e->key[0], key[0]) && file_id_eq(e->key[1], key[1])
+				&& file_id_eq(e->key[2], key[2])
+				&& (e->name == name || (e->name && name && strcmp(e->name, name) == 0))) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void cache_grow (struct cache *cache) {
+	size_t new_size = cache->size ? cache->size * 2 : CACHE_INIT_SIZE;
+	struct cache_entry **new_buckets = calloc(new_size, sizeof(*new_buckets));
+
+	if (!new_buckets) {
+		return;  // keep the current table, it just gets slower
+	}
+	for (size_t i = 0; i < cache->size; i++) {
+		struct cache_entry *next;
+		for (struct cache_entry *e = cache->buckets[i]; e; e = next) {
+			next = e->next;
+			size_t idx = cache_hash(e->key, e->name) % new_size;
+			e->next = new_buckets[idx];
+			new_buckets[idx] = e;
+		}
+	}
+	free(cache->buckets);
+	cache->buckets = new_buckets;
+	cache->size = new_size;
+}
+
+// Adds *entry* with key and name already filled into *cache*. Returns false
+// if it could not be added (then the caller still owns it).
+static bool cache_put (struct cache *cache, struct cache_entry *entry) {
+	if (cache->count >= cache->size) {
+		cache_grow(cache);
+	}
+	if (cache->size == 0) {
+		return false;
+	}
+	size_t idx = cache_hash(entry->key, entry->name) % cache->size;
+	entry->next = cache->buckets[idx];
+	cache->buckets[idx] = entry;
+	cache->count++;
+
+	return true;
+}
+
+static void cache_clear (struct cache *cache) {
+	for (size_t i = 0; i < cache->size; i++) {
+		struct cache_entry *next;
+		for (struct cache_entry *e = cache->buckets[i]; e; e = next) {
+			next = e->next;
+			free(e->name);
+			free(e);
+		}
+		cache->buckets[i] = NULL;
+	}
+	cache->count = 0;
+}
+
+static struct verdict *verdicts_get (struct file_id mapped, const struct stat *disk_sb) {
+	const struct file_id key[3] = { mapped, { disk_sb->st_dev, disk_sb->st_ino }, { 0, 0 } };
+
+	return (struct verdict *) cache_get(&verdicts, key, NULL);
+}
+
+static void verdicts_put (struct file_id mapped, const struct stat *disk_sb, int result) {
+	struct verdict *v = verdicts_get(mapped, disk_sb);
+
+	if (!v) {
+		if (!(v = calloc(1, sizeof(*v)))) {
+			return;  // just don't cache it
+		}
+		v->entry.key[0] = mapped;
+		v->entry.key[1] = (struct file_id) { disk_sb->st_dev, disk_sb->st_ino };
+
+		if (!cache_put(&verdicts, &v->entry)) {
+			free(v);
+			return;
+		}
+	}
+	v->disk_size = disk_sb->st_size;
+	v->disk_mtime = disk_sb->st_mtim;
+	v->result = result;
+}
+
+// Loads identity of the mount namespace and root directory of process *pid*
+// into *ns*, unless already loaded.
+static void proc_ns_load (pid_t pid, struct proc_ns *ns) {
+	char path[sizeof(PROC_NS_MNT_PATH) + PID_STR_MAX + 1];
+	struct stat mnt_sb, root_sb;
+
+	if (ns->loaded) {
+		return;
+	}
+	ns->loaded = true;
+
+	str_fmt(path, sizeof(path), PROC_NS_MNT_PATH, pid);
+	if (stat(path, &mnt_sb) < 0) {
+		return;
+	}
+	str_fmt(path, sizeof(path), PROC_ROOT_DIR_PATH, pid);
+	if (stat(path, &root_sb) < 0) {
+		return;
+	}
+	ns->mnt = (struct file_id) { mnt_sb.st_dev, mnt_sb.st_ino };
+	ns->root = (struct file_id) { root_sb.st_dev, root_sb.st_ino };
+	ns->valid = true;
+}
+
+// Returns the comparison of the mapped file *mapped* with the file on disk
+// *disk_sb*, queues a new one if there's none yet. Returns NULL if it could
+// not be allocated.
+static struct cmp_job *jobs_get (struct file_id mapped, const char *disk_path,
+                                 const struct stat *disk_sb, const char *mapped_path) {
+	const struct file_id key[3] = { mapped, { disk_sb->st_dev, disk_sb->st_ino }, { 0, 0 } };
+
+	struct cmp_job *job = (struct cmp_job *) cache_get(&pipeline.jobs_cache, key, NULL);
+	if (job) {
+		stats.files_cached++;
+		return job;
+	}
+	if (pipeline.jobs_cnt >= pipeline.jobs_size) {
+		size_t new_size = pipeline.jobs_size ? pipeline.jobs_size * 2 : 64;
+		struct cmp_job **tmp = realloc(pipeline.jobs, new_size * sizeof(*tmp));
+		if (!tmp) {
+			return NULL;
+		}
+		pipeline.jobs = tmp;
+		pipeline.jobs_size = new_size;
+	}
+	if (!(job = calloc(1, sizeof(*job)))) {
+		return NULL;
+	}
+	memcpy(job->entry.key, key, sizeof(key));
+	job->disk_path = strdup(disk_path);
+	job->mapped_path = strdup(mapped_path);
+	job->disk_sb = *disk_sb;
+	job->result = CMP_PENDING;
+
+	if (!job->disk_path || !job->mapped_path || !cache_put(&pipeline.jobs_cache, &job->entry)) {
+		free(job->disk_path);
+		free(job->mapped_path);
+		free(job);
+		return NULL;
+	}
+	pipeline.jobs[pipeline.jobs_cnt++] = job;
+
+	return job;
+}
+
+// Caches types of the filesystems from the mount table *path* (mountinfo),
+// unless already known.
+static void fs_types_load (const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return;
+	}
+	size_t buf_size = 512;
+	char *buf = malloc(buf_size);
+
+	while (buf && getline(&buf, &buf_size, fp) != -1) {
+		unsigned int dev_major, dev_minor;
+		char name[sizeof(((struct fs_type *) NULL)->name)];
+
+		// The type follows the separator of the optional fields.
+		const char *sep = strstr(buf, " - ");
+		if (!sep || sscanf(buf, "%*u %*u %u:%u", &dev_major, &dev_minor) != 2
+				|| sscanf(sep + 3, "%31s", name) != 1) {
+			continue;
+		}
+		const struct file_id key[3] = { { makedev(dev_major, dev_minor), 0 }, { 0, 0 }, { 0, 0 } };
+		struct fs_type *t;
+
+		if (cache_get(&fs_types, key, NULL) || !(t = calloc(1, sizeof(*t)))) {
+			continue;
+		}
+		t->entry.key[0] = key[0];
+		memcpy(t->name, name, sizeof(name));
+		if (!cache_put(&fs_types, &t->entry)) {
+			free(t);
+		}
+	}
+	free(buf);
+	fclose(fp);
+}
+
+// Returns the type of the filesystem of device *dev* of a file mapped by
+// process *pid* from *mapped_path*, or NULL if it's not a filesystem with
+// regular files (e.g. /SYSV*, memfd). The type is taken from the mount table
+// of this process or the process *pid*, since statfs(2) of a file on a hung
+// network filesystem would hang too. Devices not in the mount tables (e.g.
+// btrfs subvolumes) are checked by statfs(2) of the mapped file, just once
+// per device in a scan.
+static const char *fs_type_get (pid_t pid, dev_t dev, const char *mapped_path) {
+	const struct file_id key[3] = { { dev, 0 }, { 0, 0 }, { 0, 0 } };
+	struct fs_type *t = (struct fs_type *) cache_get(&fs_types, key, NULL);
+
+	if (!t) {
+		char path[sizeof(PROC_MOUNTINFO_PATH) + PID_STR_MAX + 1];
+
+		fs_types_load(PROC_SELF_MOUNTINFO_PATH);
+		str_fmt(path, sizeof(path), PROC_MOUNTINFO_PATH, pid);
+		fs_types_load(path);
+
+		t = (struct fs_type *) cache_get(&fs_types, key, NULL);
+	}
+	if (!t && (t = calloc(1, sizeof(*t)))) {
+		struct statfs sfs;
+
+		t->entry.key[0] = key[0];
+		if (statfs(mapped_path, &sfs) == 0) {
+			switch ((unsigned long) sfs.f_type) {
+				case BTRFS_SUPER_MAGIC:
+					strcpy(t->name, "btrfs");
+					break;
+				case OVERLAYFS_SUPER_MAGIC:
+					strcpy(t->name, "overlay");
+					break;
+			}
+		}
+		if (!cache_put(&fs_types, &t->entry)) {
+			free(t);
+			return NULL;
+		}
+	}
+	return t && t->name[0] ? t->name : NULL;
+}
+
+// Returns true if the filesystem type *name* (from the mount table) is of
+// the *type* given in a policy: the same, or with a suffix after a dot or
+// a version (e.g. fuse.sshfs, nfs4).
+static bool fs_type_matches (const char *name, const char *type, size_t type_len) {
+	return strncmp(name, type, type_len) == 0
+		&& (name[type_len] == '\0' || name[type_len] == '.' || isdigit(name[type_len]));
+}
+
+// Returns the policy for the file mapped by process *pid* from *mapped_path*
+// with device *dev*. The filesystem is checked only if any policy is given.
+static int fs_policy_get (pid_t pid, dev_t dev, const char *mapped_path) {
+	if (fs_policies.cnt == 0) {
+		return FS_POLICY_COMPARE;
+	}
+	const char *name = fs_type_get(pid, dev, mapped_path);
+	if (!name) {
+		return FS_POLICY_COMPARE;
+	}
+	for (size_t i = fs_policies.cnt; i-- > 0; ) {
+		const struct fs_policy *fp = &fs_policies.items[i];
+
+		if (fs_type_matches(name, fp->type, fp->type_len)) {
+			return fp->policy;
+		}
+	}
+	return FS_POLICY_COMPARE;
+}
+
+// Resolves comparison of the file *c->filename* mapped by process *c->pid*
+// from *mapped_path* with the file on disk (as seen by the process) from the
+// caches, or queues it for the resolve phase (then *c->job* is set). The
+// result is cached also by the mount namespace and root directory of the
+// process, so processes in the same container don't even stat the same file
+// again. In the fast mode, contents are not compared at all and
+// CMP_SUSPECTED is the result if the file on disk is not the mapped one.
+// Files on filesystems with a policy other than "compare" are not even
+// stat'ed.
+static void candidate_lookup (struct candidate *c, struct proc_ns *ns, const char *mapped_path) {
+	char disk_path[PATH_MAX];
+	struct stat sb;
+
+	c->job = NULL;
+	c->result = RET_ERROR;
+
+	int len = snprintf(disk_path, sizeof(disk_path), PROC_ROOT_PATH, c->pid, c->filename);
+	if (len <= 0 || (size_t)len >= sizeof(disk_path)) {
+		log_err("too long file path: " PROC_ROOT_PATH, c->pid, c->filename);
+		return;
+	}
+
+	proc_ns_load(c->pid, ns);
+
+	const struct file_id key[3] = { c->mapped, ns->mnt, ns->root };
+	struct ns_verdict *v = NULL;
+
+	if (ns->valid && (v = (struct ns_verdict *) cache_get(&ns_verdicts, key, c->filename))) {
+		stats.files_cached++;
+		c->job = v->job;
+		c->result = v->result;
+		return;
+	}
+	int policy = fs_policy_get(c->pid, c->mapped.dev, mapped_path);
+
+	if (policy == FS_POLICY_CHANGED) {
+		c->result = 1;
+	} else if (policy == FS_POLICY_UNCHANGED || policy == FS_POLICY_SKIP) {
+		c->result = 0;
+	} else if (stat(disk_path, &sb) < 0) {
+		return;
+	} else if (flags & FLAG_FAST) {
+		c->result = file_id_eq((struct file_id) { sb.st_dev, sb.st_ino }, c->mapped) ? 0 : CMP_SUSPECTED;
+	} else {
+		struct verdict *cached = verdicts_get(c->mapped, &sb);
+
+		// The file on disk has not been modified in place since the comparison.
+		if (cached && cached->disk_size == sb.st_size
+				&& cached->disk_mtime.tv_sec == sb.st_mtim.tv_sec
+				&& cached->disk_mtime.tv_nsec == sb.st_mtim.tv_nsec) {
+			stats.files_cached++;
+			c->result = cached->result;
+		} else if (!(c->job = jobs_get(c->mapped, disk_path, &sb, mapped_path))) {
+			return;
+		}
+	}
+
+	if (ns->valid && (v = calloc(1, sizeof(*v)))) {
+		memcpy(v->entry.key, key, sizeof(key));
+		v->entry.name = strdup(c->filename);
+		v->job = c->job;
+		v->result = c->result;
+
+		if (!v->entry.name || !cache_put(&ns_verdicts, &v->entry)) {
+			free(v->entry.name);
+			free(v);
+		}
+	}
+}
+
+// Adds the file *filename* mapped by process *pid* from *mapped_path* to the
+// candidates and looks up the result of its comparison, unless *mapped* is
+// unknown (then it cannot be compared and it's reported as replaced).
+// Returns NULL if it could not be allocated.
+static struct candidate *candidates_add (pid_t pid, struct proc_ns *ns, int reason,
+                                         const char *filename, struct file_id mapped,
+                                         off_t size, const char *mapped_path) {
+	if (pipeline.candidates_cnt >= pipeline.candidates_size) {
+		size_t new_size = pipeline.candidates_size ? pipeline.candidates_size * 2 : 256;
+		struct candidate *tmp = realloc(pipeline.candidates, new_size * sizeof(*tmp));
+		if (!tmp) {
+			return NULL;
+		}
+		pipeline.candidates = tmp;
+		pipeline.candidates_size = new_size;
+	}
+	struct candidate *c = &pipeline.candidates[pipeline.candidates_cnt];
+	*c = (struct candidate) { pid, reason, strdup(filename), mapped, size, NULL, RET_ERROR, NULL };
+
+	if (!c->filename) {
+		return NULL;
+	}
+	pipeline.candidates_cnt++;
+
+	if (mapped.ino != 0) {
+		candidate_lookup(c, ns, mapped_path);
+	}
+	// If it fails, the job is retried with paths of the other processes.
+	if (c->job) {
+		c->mapped_path = strdup(mapped_path);
+	}
+	return c;
+}
+
+static int cmp_jobs_by_disk (const void *a, const void *b) {
+	const struct stat *sa = &(*(struct cmp_job *const *)a)->disk_sb;
+	const struct stat *sb = &(*(struct cmp_job *const *)b)->disk_sb;
+
+	if (sa->st_dev != sb->st_dev) {
+		return (sa->st_dev > sb->st_dev) - (sa->st_dev < sb->st_dev);
+	}
+	return (sa->st_ino > sb->st_ino) - (sa->st_ino < sb->st_ino);
+}
+
+// Compares the files of *job* and returns the result.
+static int cmp_job_run (const struct cmp_job *job) {
+	if (limits.deadline > 0 || limits.timeout > 0) {
+		return cmp_files_timed(job);
+	}
+	return cmp_files(job->disk_path, job->mapped_path);
+}
+
+// The process that queued a job may have exited before the resolve phase,
+// then its paths are gone. Retries the failed jobs with paths of the other
+// processes that share them, until one succeeds.
+static void retry_failed_jobs (void) {
+	char disk_path[PATH_MAX];
+
+	for (size_t i = 0; i < pipeline.candidates_cnt; i++) {
+		struct candidate *c = &pipeline.candidates[i];
+		struct cmp_job *job = c->job;
+
+		if (!job || job->result != RET_ERROR || !c->mapped_path
+				|| strcmp(c->mapped_path, job->mapped_path) == 0) {
+			continue;
+		}
+		int len = snprintf(disk_path, sizeof(disk_path), PROC_ROOT_PATH, c->pid, c->filename);
+		if (len <= 0 || (size_t)len >= sizeof(disk_path)) {
+			continue;
+		}
+		char *new_disk_path = strdup(disk_path);
+		char *new_mapped_path = strdup(c->mapped_path);
+
+		if (!new_disk_path || !new_mapped_path) {
+			free(new_disk_path);
+			free(new_mapped_path);
+			continue;
+		}
+		free(job->disk_path);
+		free(job->mapped_path);
+		job->disk_path = new_disk_path;
+		job->mapped_path = new_mapped_path;
+		job->result = cmp_job_run(job);
+	}
+}
+
+// Compares files of the queued jobs until there's none left, or until
+// something has been found in the quiet mode.
+static void *cmp_jobs_worker (void *arg) {
+	(void) arg;
+	size_t i;
+
+	while (!atomic_load(&pipeline.stop)
+			&& (i = atomic_fetch_add(&pipeline.next_job, 1)) < pipeline.jobs_cnt) {
+		struct cmp_job *job = pipeline.jobs[i];
+
+		job->result = cmp_job_run(job);
+
+		// The first difference is all we need in the quiet mode (failed
+		// jobs are retried later).
+		if (job->result != 0 && job->result != RET_ERROR && flags & FLAG_QUIET) {
+			atomic_store(&pipeline.stop, true);
+		}
+	}
+#ifdef WITH_IO_URING
+	uring_free();
+#endif
+	return NULL;
+}
+
+// Resolves the queued comparisons with up to *workers_max* threads (including
+// the main one). The jobs are taken in order of the device and inode of the
+// file on disk, so reads of each device stay as sequential as possible.
+static void resolve_jobs (void) {
+	size_t threads_cnt = 0;
+	pthread_t *threads = NULL;
+
+	if (pipeline.jobs_cnt == 0) {
+		return;
+	}
+	// Reap children of timed out comparisons of previous scans, if any.
+	while (waitpid(-1, NULL, WNOHANG) > 0);
+
+	qsort(pipeline.jobs, pipeline.jobs_cnt, sizeof(*pipeline.jobs), cmp_jobs_by_disk);
+	atomic_store(&pipeline.next_job, 0);
+	atomic_store(&pipeline.stop, false);
+
+	size_t wanted = workers_max - 1;
+	if (wanted > pipeline.jobs_cnt - 1) {
+		wanted = pipeline.jobs_cnt - 1;
+	}
+	if (wanted > 0 && (threads = malloc(wanted * sizeof(*threads)))) {
+		for (; threads_cnt < wanted; threads_cnt++) {
+			// If the thread cannot be created, the rest does it.
+			if (pthread_create(&threads[threads_cnt], NULL, cmp_jobs_worker, NULL) != 0) {
+				break;
+			}
+		}
+	}
+	(void) cmp_jobs_worker(NULL);
+
+	for (size_t i = 0; i < threads_cnt; i++) {
+		(void) pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	retry_failed_jobs();
+
+	for (size_t i = 0; i < pipeline.jobs_cnt; i++) {
+		struct cmp_job *job = pipeline.jobs[i];
+
+		if (job->result == CMP_PENDING) {
+			continue;  // cancelled
+		}
+		stats.files_compared++;
+		if (job->result == CMP_UNKNOWN) {
+			stats.files_unknown++;
+		} else if (job->result != RET_ERROR) {
+			verdicts_put(job->entry.key[0], &job->disk_sb, job->result);
+		}
+	}
+}
+
+// Releases candidates and jobs of the last scan.
+static void pipeline_clear (void) {
+	for (size_t i = 0; i < pipeline.candidates_cnt; i++) {
+		free(pipeline.candidates[i].filename);
+		free(pipeline.candidates[i].mapped_path);
+	}
+	for (size_t i = 0; i < pipeline.jobs_cnt; i++) {
+		free(pipeline.jobs[i]->disk_path);
+		free(pipeline.jobs[i]->mapped_path);
+	}
+	cache_clear(&pipeline.jobs_cache);
+	pipeline.candidates_cnt = 0;
+	pipeline.jobs_cnt = 0;
+	pipeline.procs.cnt = 0;
+}
+
+static pid_t next_pid (DIR *proc_dir) {
+	struct dirent *entry;
+	pid_t pid;
+
+	while ((entry = readdir(proc_dir))) {
+		if ((pid = str_to_uint(entry->d_name)) != -1) {
+			return pid;
+		}
+	}
+	return -1;
+}
+
+static bool is_kernel_proc (pid_t pid) {
+	char exe_path[sizeof(PROC_EXE_PATH) + PID_STR_MAX + 1];
+
+	// /proc/<pid>/exe
+	str_fmt(exe_path, sizeof(exe_path), PROC_EXE_PATH, pid);
+
+	// See https://stackoverflow.com/a/12231039/2217862.
+	if (readlink(exe_path, (char[]) { '\0' }, 1) < 0 && errno == ENOENT) {
+		struct stat sb;
+		return lstat(exe_path, &sb) == 0;
+	}
+	return false;
+}
+
+static int proc_exists (pid_t pid) {
+
+	if (kill(pid, 0) == 0) {
+		return 0;
+	} else if (errno == ESRCH) {
+		return 1;
+	} else {
+		return RET_ERROR;
+	}
+}
+
+static int resolve_link (const char *pathname, char *buff, size_t buff_size) {
+
+	errno = 0;
+	ssize_t size = readlink(pathname, buff, buff_size - 1);
+	if (size < 0 || (size_t)size >= buff_size) {
+		return RET_ERROR;
+	}
+	buff[size] = '\0';  // readlink does not end string with \0!
+
+	return 0;
+}
+
+// Reads PPID and session ID of process *pid* from /proc/<pid>/stat.
+static int proc_stat_ids (pid_t pid, pid_t *ppid, pid_t *sid) {
+	char path[sizeof(PROC_STAT_PATH) + PID_STR_MAX + 1];
+	char buf[512];  // comm is at most 16 chars, so this is more than enough
+
+	str_fmt(path, sizeof(path), PROC_STAT_PATH, pid);
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return RET_ERROR;
+	}
+	ssize_t len = read(fd, buf, sizeof(buf) - 1);
+	(void) close(fd);
+
+	if (len <= 0) {
+		return RET_ERROR;
+	}
+	buf[len] = '\0';
+
+	// The comm field may contain anything, including spaces and parens.
+	char *p = strrchr(buf, ')');
+	int ppid_, sid_;
+	if (!p || sscanf(p + 1, " %*c %d %*d %d", &ppid_, &sid_) != 2) {
+		return RET_ERROR;
+	}
+	*ppid = (pid_t) ppid_;
+	*sid = (pid_t) sid_;
+
+	return 0;
+}
+
+// Reads path of the executable of process *pid* into *buf* with suffixes
+// " (deleted)" and ".apk-new" stripped.
+static int proc_exe_path (pid_t pid, char *buf, size_t buf_size) {
+	char path[sizeof(PROC_EXE_PATH) + PID_STR_MAX + 1];
+
+	str_fmt(path, sizeof(path), PROC_EXE_PATH, pid);
+	if (resolve_link(path, buf, buf_size) < 0) {
+		return RET_ERROR;
+	}
+	(void) str_chomp(buf, " (deleted)");
+	(void) str_chomp(buf, ".apk-new");
+
+	return 0;
+}
+
+// Finds the top-most ancestor of process *pid* that has the same executable
+// and is in the same session, i.e. the master process of a daemon with
+// forked workers. Returns *pid* itself if there's no such ancestor.
+static pid_t proc_group_leader (pid_t pid) {
+	char exe[PATH_MAX], parent_exe[PATH_MAX];
+	pid_t leader = pid, ppid, sid, parent_ppid, parent_sid;
+
+	if (proc_exe_path(pid, exe, sizeof(exe)) < 0 || proc_stat_ids(pid, &ppid, &sid) < 0) {
+		return pid;
+	}
+	while (ppid > 1
+			&& proc_stat_ids(ppid, &parent_ppid, &parent_sid) == 0
+			&& parent_sid == sid
+			&& proc_exe_path(ppid, parent_exe, sizeof(parent_exe)) == 0
+			&& strcmp(parent_exe, exe) == 0) {
+		leader = ppid;
+		ppid = parent_ppid;
+	}
+	return leader;
+}
+
+// Returns true if the mapped *file* is one of the candidates of the process
+// reported as replaced or unknown.
+static bool cost_is_reported (struct file_id file) {
+	for (size_t i = 0; i < cost.candidates_cnt; i++) {
+		const struct candidate *c = &cost.candidates[i];
+		int cmp_res = c->job ? c->job->result : c->result;
+
+		if (cmp_res != 0 && cmp_res != CMP_PENDING && file_id_eq(c->mapped, file)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// Loads memory used by stale mappings of process *pid* into *cost*, unless
+// already loaded. Only mappings of the files reported as replaced or unknown
+// are counted.
+static void proc_cost_load (pid_t pid) {
+	char path[sizeof(PROC_SMAPS_PATH) + PID_STR_MAX + 1];
+
+	if (cost.pid == pid) {
+		return;
+	}
+	for (size_t i = 0; i < cost.files_cnt; i++) {
+		free(cost.files[i].path);
+	}
+	cost.pid = pid;
+	cost.files_cnt = 0;
+	cost.total = (struct mem_cost) { 0, 0 };
+
+	str_fmt(path, sizeof(path), PROC_SMAPS_PATH, pid);
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		return;
+	}
+
+	size_t buf_size = PATH_MAX + 1;
+	char *buf = malloc(buf_size);
+	char filename[PATH_MAX + 1];
+	struct mem_cost *cur = NULL;  // cost of the current stale mapping
+
+	while (buf && getline(&buf, &buf_size, fp) != -1) {
+		unsigned long value, inode;
+		unsigned int dev_major, dev_minor;
+
+		// Mapping header (the same format as in maps) starts with a hex
+		// digit, attributes (e.g. "Rss:") with an uppercase letter.
+		if (isxdigit(buf[0]) && !isupper(buf[0])) {
+			cur = NULL;
+
+			if (!str_chomp(buf, " (deleted)\n")) {
+				continue;
+			}
+			(void) str_chomp(buf, ".apk-new");
+
+			if (sscanf(buf, "%*x-%*x %*s %*x %x:%x %lu%*[ \t]%" STR(PATH_MAX) "[^\n]s",
+			           &dev_major, &dev_minor, &inode, filename) < 4 || inode == 0) {
+				continue;
+			}
+			// This skips also non-file mappings with major 0 (e.g. /SYSV*),
+			// since these are never collected as candidates.
+			if (!cost_is_reported((struct file_id) { makedev(dev_major, dev_minor), inode })) {
+				continue;
+			}
+			for (size_t i = 0; i < cost.files_cnt; i++) {
+				if (strcmp(cost.files[i].path, filename) == 0) {
+					cur = &cost.files[i].cost;
+					break;
+				}
+			}
+			if (!cur) {
+				struct file_cost *tmp = realloc(cost.files, (cost.files_cnt + 1) * sizeof(*tmp));
+				if (!tmp || !(tmp[cost.files_cnt].path = strdup(filename))) {
+					cost.files = tmp ? tmp : cost.files;
+					continue;
+				}
+				cost.files = tmp;
+				tmp[cost.files_cnt].cost = (struct mem_cost) { 0, 0 };
+				cur = &tmp[cost.files_cnt++].cost;
+			}
+		} else if (cur && sscanf(buf, "Rss: %lu kB", &value) == 1) {
+			cur->rss += value;
+			cost.total.rss += value;
+		} else if (cur && sscanf(buf, "Pss: %lu kB", &value) == 1) {
+			cur->pss += value;
+			cost.total.pss += value;
+		}
+	}
+	free(buf);
+	fclose(fp);
+
+	stats.stale.rss += cost.total.rss;
+	stats.stale.pss += cost.total.pss;
+}
+
+// Returns memory used by stale mappings of file *filename* in process *pid*,
+// or of all files if *filename* is NULL.
+static struct mem_cost proc_cost_get (pid_t pid, const char *filename) {
+	proc_cost_load(pid);
+
+	if (!filename) {
+		return cost.total;
+	}
+	for (size_t i = 0; i < cost.files_cnt; i++) {
+		if (strcmp(cost.files[i].path, filename) == 0) {
+			return cost.files[i].cost;
+		}
+	}
+	return (struct mem_cost) { 0, 0 };
+}
+
+// Loads executable and command line of process *pid* into *proc_info*,
+// unless already loaded. Arguments of the command line are separated by
+// spaces and control characters are replaced by spaces as well.
+static void proc_info_load (pid_t pid) {
+	char path[sizeof(PROC_CMDLINE_PATH) + PID_STR_MAX + 1];
+
+	if (proc_info.pid == pid) {
+		return;
+	}
+	proc_info.pid = pid;
+
+	if (proc_exe_path(pid, proc_info.exe, sizeof(proc_info.exe)) < 0) {
+		proc_info.exe[0] = '\0';
+	}
+	if (!proc_info.cmdline) {
+		proc_info.cmdline_size = 4096;
+		if (!(proc_info.cmdline = malloc(proc_info.cmdline_size))) {
+			proc_info.cmdline_size = 0;
+			return;
+		}
+	}
+	proc_info.cmdline[0] = '\0';
+
+	str_fmt(path, sizeof(path), PROC_CMDLINE_PATH, pid);
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	size_t len = 0;
+	ssize_t n;
+	while ((n = read(fd, proc_info.cmdline + len, proc_info.cmdline_size - len - 1)) > 0) {
+		len += (size_t) n;
+
+		if (len + 1 >= proc_info.cmdline_size) {
+			char *tmp = realloc(proc_info.cmdline, proc_info.cmdline_size * 2);
+			if (!tmp) {
+				break;
+			}
+			proc_info.cmdline = tmp;
+			proc_info.cmdline_size *= 2;
+		}
+	}
+	(void) close(fd);
+
+	while (len > 0 && proc_info.cmdline[len - 1] == '\0') {
+		len--;  // strip trailing NULs
+	}
+	for (size_t i = 0; i < len; i++) {
+		if (iscntrl((unsigned char) proc_info.cmdline[i])) {
+			proc_info.cmdline[i] = ' ';
+		}
+	}
+	proc_info.cmdline[len] = '\0';
+}
+
+// Prints *str* as a JSON string.
+static void print_json_str (const char *str) {
+	putchar('"');
+	for (const unsigned char *c = (const unsigned char *) str; *c; c++) {
+		if (*c == '"' || *c == '\\') {
+			printf("\\%c", *c);
+		} else if (*c < 0x20) {
+			printf("\\u%04x", *c);
+		} else {
+			putchar(*c);
+		}
+	}
+	putchar('"');
+}
+
+// Prints a field of the record: "key":value in JSON, or key=value\0 in the
+// NUL-delimited format. *str* is printed if not NULL, otherwise *num*.
+static void print_field (bool *first, const char *key, const char *str, long long num) {
+	if (flags & FLAG_JSON) {
+		printf("%s\"%s\":", *first ? "" : ",", key);
+		if (str) {
+			print_json_str(str);
+		} else {
+			printf("%lld", num);
+		}
+	} else {
+		printf("%s=", key);
+		if (str) {
+			fputs(str, stdout);
+		} else {
+			printf("%lld", num);
+		}
+		putchar('\0');
+	}
+	*first = false;
+}
+
+// Prints field "pids" of a record: a JSON array, or PIDs separated by a space
+// in the NUL format.
+static void print_pids_field (bool *first, const struct pid_list *pids) {
+	if (flags & FLAG_JSON) {
+		printf("%s\"pids\":[", *first ? "" : ",");
+	} else {
+		printf("pids=");
+	}
+	for (size_t i = 0; i < pids->cnt; i++) {
+		printf("%s%d", i ? (flags & FLAG_JSON ? "," : " ") : "", pids->items[i]);
+	}
+	if (flags & FLAG_JSON) {
+		putchar(']');
+	} else {
+		putchar('\0');
+	}
+	*first = false;
+}
+
+// Prints one record of the report. In the text format, it's a line with PID,
+// path of the file (with FLAG_VERBOSE) and marks separated by tabs. A record
+// of a stale file (with *pids*) starts with the path and PIDs separated by
+// a space instead.
+static void print_record (const struct record *r) {
+	static const char *const reasons[] = { "exe", "map", "fd" };
+
+	if (flags & (FLAG_JSON | FLAG_NUL)) {
+		bool first = true;
+		char dev[32];
+
+		if (flags & FLAG_JSON) putchar('{');
+		if (r->pids) {
+			print_field(&first, "file", r->filename, 0);
+		} else {
+			print_field(&first, "pid", NULL, r->pid);
+		}
+		print_field(&first, "reason", reasons[r->reason], 0);
+		if (r->filename && !r->pids) {
+			print_field(&first, "file", r->filename, 0);
+		}
+		if (r->file.ino) {
+			str_fmt(dev, sizeof(dev), "%u:%u", major(r->file.dev), minor(r->file.dev));
+			print_field(&first, "dev", dev, 0);
+			print_field(&first, "inode", NULL, (long long) r->file.ino);
+		}
+		if (r->size >= 0) {
+			print_field(&first, "size", NULL, (long long) r->size);
+		}
+		if (r->pids) {
+			print_pids_field(&first, r->pids);
+		} else {
+			proc_info_load(r->pid);
+			print_field(&first, "exe", proc_info.exe, 0);
+			print_field(&first, "cmdline", proc_info.cmdline ? proc_info.cmdline : "", 0);
+		}
+		if (r->suspected) {
+			print_field(&first, "suspected", NULL, 1);
+		}
+		if (r->unknown) {
+			print_field(&first, "unknown", NULL, 1);
+		}
+		if (r->procs) {
+			print_field(&first, "procs", NULL, r->procs);
+		}
+		if (r->mem) {
+			print_field(&first, "rss", NULL, (long long) r->mem->rss);
+			print_field(&first, "pss", NULL, (long long) r->mem->pss);
+		}
+		if (flags & FLAG_JSON) {
+			puts("}");
+		} else {
+			putchar('\0');  // mark end of the record
+		}
+		return;
+	}
+
+	if (r->pids) {
+		printf("%s\t", r->filename);
+		for (size_t i = 0; i < r->pids->cnt; i++) {
+			printf("%s%d", i ? " " : "", r->pids->items[i]);
+		}
+	} else {
+		printf("%d", r->pid);
+		if (r->filename && flags & FLAG_VERBOSE) {
+			printf("\t%s", r->filename);
+		}
+	}
+	if (r->reason == REASON_FD) {
+		printf("\tfd\tsize=%lld", (long long) r->size);
+	}
+	if (r->suspected) {
+		printf("\tsuspected");
+	}
+	if (r->unknown) {
+		printf("\tunknown");
+	}
+	if (r->procs) {
+		printf("\tprocs=%u", r->procs);
+	}
+	if (r->mem) {
+		printf("\trss=%lu\tpss=%lu", r->mem->rss, r->mem->pss);
+	}
+	printf("\n");
+}
+
+static struct proc_group *groups_find (pid_t leader) {
+	for (size_t i = 0; i < groups.cnt; i++) {
+		if (groups.items[i].leader == leader) {
+			return &groups.items[i];
+		}
+	}
+	if (groups.cnt >= groups.size) {
+		size_t new_size = groups.size ? groups.size * 2 : 64;
+		struct proc_group *tmp = realloc(groups.items, new_size * sizeof(*tmp));
+		if (!tmp) {
+			return NULL;
+		}
+		groups.items = tmp;
+		groups.size = new_size;
+	}
+	struct proc_group *g = &groups.items[groups.cnt++];
+	*g = (struct proc_group) {
+		.leader = leader, .reason = -1, .suspected = true, .unknown = true
+	};
+
+	return g;
+}
+
+// Adds the report to the group of process *pid*. Returns false if it could
+// not be added.
+static bool groups_add (const struct record *r) {
+	pid_t pid = r->pid;
+	const char *filename = r->filename;
+	struct proc_group *g = groups_find(proc_group_leader(pid));
+	if (!g) {
+		return false;
+	}
+	if (g->last_pid != pid) {
+		g->last_pid = pid;
+		g->procs++;
+
+		if (flags & FLAG_COST) {
+			struct mem_cost mem = proc_cost_get(pid, NULL);
+			g->mem.rss += mem.rss;
+			g->mem.pss += mem.pss;
+		}
+	}
+	if (g->reason < 0) {
+		g->reason = r->reason;
+	}
+	if (r->reason == REASON_FD) {
+		g->size += r->size;
+	}
+	if (!r->suspected) {
+		g->suspected = false;
+	}
+	if (!r->unknown) {
+		g->unknown = false;
+	}
+	if (!(flags & FLAG_VERBOSE)) {
+		return true;
+	}
+	struct mem_cost mem = { 0, 0 };
+	if (flags & FLAG_COST) {
+		mem = proc_cost_get(pid, filename);
+	}
+	for (size_t i = 0; i < g->files_cnt; i++) {
+		struct group_file *f = &g->files[i];
+
+		if (strcmp(f->path, filename) == 0) {
+			f->suspected &= r->suspected;
+			f->unknown &= r->unknown;
+
+			// Executable is typically reported twice for the same process.
+			if (f->last_pid != pid) {
+				f->last_pid = pid;
+				f->mem.rss += mem.rss;
+				f->mem.pss += mem.pss;
+			}
+			return true;
+		}
+	}
+	struct group_file *tmp = realloc(g->files, (g->files_cnt + 1) * sizeof(*tmp));
+	if (!tmp) {
+		return false;
+	}
+	g->files = tmp;
+	g->files[g->files_cnt] = (struct group_file) {
+		strdup(filename), pid, r->reason, r->file, r->size, r->suspected, r->unknown, mem
+	};
+	if (!g->files[g->files_cnt].path) {
+		return false;
+	}
+	g->files_cnt++;
+
+	return true;
+}
+
+// Prints the collected groups and clears them.
+static void groups_flush (void) {
+	const bool with_cost = flags & FLAG_COST;
+
+	for (size_t i = 0; i < groups.cnt; i++) {
+		struct proc_group *g = &groups.items[i];
+
+		if (flags & FLAG_VERBOSE) {
+			for (size_t j = 0; j < g->files_cnt; j++) {
+				struct group_file *f = &g->files[j];
+
+				print_record(&(struct record) {
+					.pid = g->leader,
+					.reason = f->reason,
+					.filename = f->path,
+					.file = f->file,
+					.size = f->size,
+					.suspected = f->suspected,
+					.unknown = f->unknown,
+					.procs = g->procs,
+					.mem = with_cost ? &f->mem : NULL,
+				});
+				free(f->path);
+			}
+			free(g->files);
+		} else {
+			print_record(&(struct record) {
+				.pid = g->leader,
+				.reason = g->reason,
+				.size = g->reason == REASON_FD ? g->size : -1,
+				.suspected = g->suspected,
+				.unknown = g->unknown,
+				.procs = g->procs,
+				.mem = with_cost ? &g->mem : NULL,
+			});
+		}
+	}
+	groups.cnt = 0;
+}
+
+// Appends *pid* to the *list*; there's always space left for the terminating
+// -1.
+static int pid_list_push (struct pid_list *list, pid_t pid) {
+	if (list->cnt + 1 >= list->size) {
+		size_t new_size = list->size ? list->size * 2 : 256;
+		pid_t *tmp = realloc(list->items, new_size * sizeof(*tmp));
+		if (!tmp) {
+			log_err("%s", strerror(errno));
+			return RET_ERROR;
+		}
+		list->items = tmp;
+		list->size = new_size;
+	}
+	list->items[list->cnt++] = pid;
+	list->items[list->cnt] = -1;  // mark end of the array
+
+	return 0;
+}
+
+
+// Adds process *r->pid* (or its group leader with FLAG_GROUP) to the index
+// of stale files under *r->filename*.
+static void by_file_add (const struct record *r) {
+	const struct file_id key[3] = { r->file, { 0, 0 }, { 0, 0 } };
+
+	struct stale_file *f = (struct stale_file *) cache_get(&by_file.cache, key, r->filename);
+	if (!f) {
+		if (by_file.cnt >= by_file.size) {
+			size_t new_size = by_file.size ? by_file.size * 2 : 64;
+			struct stale_file **tmp = realloc(by_file.items, new_size * sizeof(*tmp));
+			if (!tmp) {
+				return;
+			}
+			by_file.items = tmp;
+			by_file.size = new_size;
+		}
+		if (!(f = calloc(1, sizeof(*f)))) {
+			return;
+		}
+		*f = (struct stale_file) {
+			.entry = { .key = { r->file }, .name = strdup(r->filename) },
+			.reason = r->reason,
+			.size = r->size,
+			.suspected = true,
+			.unknown = true,
+			.last_pid = -1,
+			.index = by_file.cnt,
+		};
+		if (!f->entry.name || !cache_put(&by_file.cache, &f->entry)) {
+			free(f->entry.name);
+			free(f);
+			return;
+		}
+		by_file.items[by_file.cnt++] = f;
+	}
+	f->suspected &= r->suspected;
+	f->unknown &= r->unknown;
+
+	// Executable is typically reported twice for the same process.
+	if (f->last_pid != r->pid) {
+		f->last_pid = r->pid;
+		if (r->mem) {
+			f->mem.rss += r->mem->rss;
+			f->mem.pss += r->mem->pss;
+		}
+	}
+
+	// Files of one process are reported in a row, so it's enough to compare
+	// with the last PID, unless the processes are collapsed into groups.
+	pid_t pid = r->pid;
+	if (f->pids.cnt > 0 && f->pids.items[f->pids.cnt - 1] == pid) {
+		return;
+	}
+	if (flags & FLAG_GROUP) {
+		if (pid != by_file.last_pid) {
+			by_file.last_pid = pid;
+			by_file.last_leader = proc_group_leader(pid);
+		}
+		pid = by_file.last_leader;
+
+		const struct file_id leader_key[3] = {
+			r->file, { 0, (ino_t) pid }, { 0, (ino_t) f->index }
+		};
+		if (cache_get(&by_file.leaders, leader_key, NULL)) {
+			return;
+		}
+		struct cache_entry *e = calloc(1, sizeof(*e));
+		if (e) {
+			memcpy(e->key, leader_key, sizeof(leader_key));
+			if (!cache_put(&by_file.leaders, e)) free(e);
+		}
+	}
+	(void) pid_list_push(&f->pids, pid);
+}
+
+// Prints the index of stale files and clears it. In the text format, each
+// file is printed on one line with path, PIDs separated by a space and marks,
+// separated by tabs.
+static void by_file_flush (void) {
+	for (size_t i = 0; i < by_file.cnt; i++) {
+		struct stale_file *f = by_file.items[i];
+
+		print_record(&(struct record) {
+			.reason = f->reason,
+			.filename = f->entry.name,
+			.file = f->entry.key[0],
+			.size = f->size,
+			.suspected = f->suspected,
+			.unknown = f->unknown,
+			.procs = (unsigned int) f->pids.cnt,
+			.mem = flags & FLAG_COST ? &f->mem : NULL,
+			.pids = &f->pids,
+		});
+		free(f->pids.items);
+		f->pids = (struct pid_list) { NULL, 0, 0 };
+	}
+	by_file.cnt = 0;
+	by_file.last_pid = by_file.last_leader = -1;
+	cache_clear(&by_file.cache);
+	cache_clear(&by_file.leaders);
+}
+
+// Reports that process *r->pid* uses the replaced file *r->filename*.
+static void report (struct record *r) {
+	struct mem_cost mem;
+
+	if (flags & FLAG_QUIET) {
+		return;
+	} else if (flags & FLAG_GROUP && !(flags & FLAG_BY_FILE) && groups_add(r)) {
+		return;
+	}
+	if (flags & FLAG_COST) {
+		mem = proc_cost_get(r->pid, flags & FLAG_VERBOSE ? r->filename : NULL);
+		r->mem = &mem;
+	}
+	if (flags & FLAG_BY_FILE) {
+		by_file_add(r);
+	} else {
+		print_record(r);
+	}
+}
+
+// Finds regular files that have been deleted, but process *pid* still holds
+// them open, and reports them with their size. Each file is counted only once
+// per process and once in the total. If the process has been already
+// *reported* (for a stale mapping), it's not reported again unless verbose.
+static int proc_deleted_fds (pid_t pid, const char **file_patterns, bool reported) {
+	char fd_path[sizeof(PROC_FD_PATH) + PID_STR_MAX + 1];
+	char link_path[PATH_MAX];
+	int res = 1;
+	off_t proc_size = 0;
+
+	str_fmt(fd_path, sizeof(fd_path), PROC_FD_PATH, pid);
+
+	DIR *dir = opendir(fd_path);
+	if (!dir) {
+		int opendir_err = errno;
+
+		if (opendir_err == EACCES && flags & FLAG_IGNORE_EACCES) {
+			return 1;  // no
+		}
+		// If process does not exist anymore, then it's not an error.
+		if (proc_exists(pid) == 1) {
+			return 1;  // no
+		}
+		log_err("%s: %s", fd_path, strerror(opendir_err));
+		return RET_ERROR;
+	}
+	int dir_fd = dirfd(dir);
+
 	struct dirent *entry;
-	pid_t pid;
+	while ((entry = readdir(dir))) {
+		struct stat sb;
 
-	while ((entry = readdir(proc_dir))) {
-		if ((pid = str_to_uint(entry->d_name)) != -1) {
-			return pid;
+		if (entry->d_name[0] == '.') {
+			continue;
 		}
-	}
-	return -1;
-}
+		ssize_t len = readlinkat(dir_fd, entry->d_name, link_path, sizeof(link_path) - 1);
+		if (len < 0) {
+			continue;
+		}
+		link_path[len] = '\0';
 
-static bool is_kernel_proc (pid_t pid) {
-	char exe_path[sizeof(PROC_EXE_PATH) + PID_STR_MAX + 1];
+		// Skip sockets, pipes, anon inodes, memfds and existing files.
+		if (link_path[0] != '/' || strncmp(link_path, "/memfd:", 7) == 0
+				|| !str_chomp(link_path, " (deleted)")) {
+			continue;
+		}
+		if (file_patterns[0] && !fnmatch_any(file_patterns, link_path, 0)) {
+			continue;
+		}
+		// The path may have been deleted, but the file still linked elsewhere.
+		if (fstatat(dir_fd, entry->d_name, &sb, 0) < 0 || !S_ISREG(sb.st_mode)
+				|| sb.st_nlink != 0) {
+			continue;
+		}
 
-	// /proc/<pid>/exe
-	str_fmt(exe_path, sizeof(exe_path), PROC_EXE_PATH, pid);
+		struct file_id file = { sb.st_dev, sb.st_ino };
+		const struct file_id proc_key[3] = { file, { 0, (ino_t) pid }, { 0, 0 } };
+		const struct file_id total_key[3] = { file, { 0, 0 }, { 0, 0 } };
 
-	// See https://stackoverflow.com/a/12231039/2217862.
-	if (readlink(exe_path, (char[]) { '\0' }, 1) < 0 && errno == ENOENT) {
-		struct stat sb;
-		return lstat(exe_path, &sb) == 0;
-	}
-	return false;
-}
+		// Skip files already reported for this process (e.g. dup'ed fds).
+		if (cache_get(&deleted_fds, proc_key, NULL)) {
+			continue;
+		}
+		struct cache_entry *e = calloc(1, sizeof(*e));
+		if (e) {
+			memcpy(e->key, proc_key, sizeof(proc_key));
+			if (!cache_put(&deleted_fds, e)) free(e);
+		}
+		if (!cache_get(&deleted_fds, total_key, NULL) && (e = calloc(1, sizeof(*e)))) {
+			memcpy(e->key, total_key, sizeof(total_key));
+			if (!cache_put(&deleted_fds, e)) free(e);
+			stats.deleted_size += sb.st_size;
+		}
 
-static int proc_exists (pid_t pid) {
+		res = 0;  // yes
+		proc_size += sb.st_size;
 
-	if (kill(pid, 0) == 0) {
-		return 0;
-	} else if (errno == ESRCH) {
-		return 1;
-	} else {
-		return RET_ERROR;
+		if (flags & FLAG_QUIET) {
+			break;
+		} else if (flags & FLAG_VERBOSE) {
+			report(&(struct record) {
+				.pid = pid,
+				.reason = REASON_FD,
+				.filename = link_path,
+				.file = file,
+				.size = sb.st_size,
+			});
+		}
 	}
-}
-
-static int resolve_link (const char *pathname, char *buff, size_t buff_size) {
+	closedir(dir);
 
-	errno = 0;
-	ssize_t size = readlink(pathname, buff, buff_size - 1);
-	if (size < 0 || (size_t)size >= buff_size) {
-		return RET_ERROR;
+	if (res == 0 && !reported && !(flags & (FLAG_QUIET | FLAG_VERBOSE))) {
+		report(&(struct record) { .pid = pid, .reason = REASON_FD, .size = proc_size });
 	}
-	buff[size] = '\0';  // readlink does not end string with \0!
-
-	return 0;
+	return res;
 }
 
-static int proc_maps_replaced_files (pid_t pid, const char **file_patterns) {
+// Collects deleted (or replaced) files mapped by process *pid*. Returns 0 if
+// any of them is already known to be replaced, 1 if not (yet).
+static int proc_collect_maps (pid_t pid, struct proc_ns *ns, const char **file_patterns) {
 	int res = 1;
 	struct map_info map;
 	char last_filename[PATH_MAX + 1] = { '\0' };
@@ -273,6 +2794,7 @@ static int proc_maps_replaced_files (pid_t pid, const char **file_patterns) {
 		char maps_path[sizeof(PROC_MAPS_PATH) + PID_STR_MAX + 1];
 		str_fmt(maps_path, sizeof(maps_path), PROC_MAPS_PATH, pid);
 
+		throttle_acquire(0, 1);
 		if ((maps_fp = fopen(maps_path, "r")) == NULL) {
 			int fopen_err = errno;
 
@@ -301,8 +2823,9 @@ static int proc_maps_replaced_files (pid_t pid, const char **file_patterns) {
 		(void) str_chomp(buf, ".apk-new");
 
 		// Parse the line and skip if it has wrong format.
-		if (sscanf(buf, "%lx-%lx %*c%*c%*c%*c %*x %x:%*x %lu%*[ \t]%" STR(PATH_MAX) "[^\n]s",
-		           &map.start, &map.end, &map.dev_major, &map.inode, map.filename) < 5) {
+		if (sscanf(buf, "%lx-%lx %*c%*c%*c%*c %*x %x:%x %lu%*[ \t]%" STR(PATH_MAX) "[^\n]s",
+		           &map.start, &map.end, &map.dev_major, &map.dev_minor, &map.inode,
+		           map.filename) < 6) {
 			continue;
 		}
 		// One filename is typically repeated three times in a row with
@@ -313,28 +2836,37 @@ static int proc_maps_replaced_files (pid_t pid, const char **file_patterns) {
 		strncpy(last_filename, map.filename, sizeof(last_filename));
 
 		// Skip non-file entries.
-		// Entries like /SYSV00000000, /drm, /i915 etc. have major 0.
-		if (map.inode == 0 || map.dev_major == 0) {
+		if (map.inode == 0) {
 			continue;
 		}
 		// Skip files excluded based on given patterns, if any.
 		if (file_patterns[0] && !fnmatch_any(file_patterns, map.filename, 0)) {
 			continue;
 		}
-		// Compare the file on disk with the mapped one and skip if
-		// they are identical.
 		str_fmt(buf, buf_size, PROC_MAP_FILES_PATH, pid, map.start, map.end);
-		if (cmp_files(map.filename, buf) == 0) {
+
+		// Entries like /SYSV00000000, /drm, /i915 etc. have major 0, but so
+		// do files on network filesystems, FUSE, tmpfs, overlayfs and btrfs.
+		if (map.dev_major == 0
+				&& !fs_type_get(pid, makedev(map.dev_major, map.dev_minor), buf)) {
 			continue;
 		}
+		// Collect the file for comparison with the file on disk (as seen by
+		// the process).
+		struct file_id mapped = { makedev(map.dev_major, map.dev_minor), map.inode };
+		struct stat sb;
+		// The size is needed only for the machine-readable formats.
+		off_t size = flags & (FLAG_JSON | FLAG_NUL) && stat(buf, &sb) == 0 ? sb.st_size : -1;
 
-		res = 0;  // yes
-		if (flags & FLAG_VERBOSE) {
-			printf("%d\t%s\n", pid, map.filename);
-		} else {
-			printf("%d\n", pid);
+		struct candidate *c = candidates_add(pid, ns, REASON_MAP, map.filename, mapped, size, buf);
+		if (!c) {
+			log_err("%s", strerror(ENOMEM));
+			res = RET_ERROR;
 			break;
 		}
+		if (!c->job && c->result != 0) {
+			res = 0;  // yes
+		}
 	}
 
 	free(buf);
@@ -343,7 +2875,9 @@ static int proc_maps_replaced_files (pid_t pid, const char **file_patterns) {
 	return res;
 }
 
-static int proc_has_replaced_exe (pid_t pid, const char **file_patterns) {
+// Collects the executable of process *pid* if it has been deleted (or
+// replaced). Returns 0 if it's already known to be replaced, 1 if not (yet).
+static int proc_collect_exe (pid_t pid, struct proc_ns *ns, const char **file_patterns) {
 	char exe_path[sizeof(PROC_EXE_PATH) + PID_STR_MAX + 1];
 	char link_path[PATH_MAX];
 
@@ -376,47 +2910,314 @@ static int proc_has_replaced_exe (pid_t pid, const char **file_patterns) {
 		return 1;  // no
 	}
 
-	{
-		char file_path[PATH_MAX];
+	// Collect the executable for comparison with the file on disk (as seen
+	// by the process).
+	struct candidate *c;
+	struct stat sb;
+
+	if (stat(exe_path, &sb) == 0) {
+		c = candidates_add(pid, ns, REASON_EXE, link_path,
+		                   (struct file_id) { sb.st_dev, sb.st_ino }, sb.st_size, exe_path);
+	} else {
+		c = candidates_add(pid, ns, REASON_EXE, link_path, (struct file_id) { 0, 0 }, -1, exe_path);
+	}
+	if (!c) {
+		log_err("%s", strerror(ENOMEM));
+		return RET_ERROR;
+	}
+	return !c->job && c->result != 0 ? 0 : 1;
+}
 
-		int len = snprintf(file_path, sizeof(file_path), PROC_ROOT_PATH, pid, link_path);
-		if (len <= 0 || (size_t)len >= sizeof(file_path)) {
-			log_err("too long file path: " PROC_ROOT_PATH, pid, link_path);
+static int cmp_pids (const void *a, const void *b) {
+	pid_t pa = *(const pid_t *)a, pb = *(const pid_t *)b;
+	return (pa > pb) - (pa < pb);
+}
 
-		// Compare the file on disk with the mapped one, return 1 (no) if they
-		// are identical.
-		} else if (cmp_files(exe_path, file_path) == 0) {
-			return 1;  // no
+// Appends PIDs from cgroup.procs in the cgroup directory *dir* and all its
+// descendants to *pids*. A *nested* cgroup that vanished meanwhile is empty.
+static int read_cgroup_procs (const char *dir, struct pid_list *pids, bool nested) {
+	char path[PATH_MAX];
+	int res = 0;
+
+	int len = snprintf(path, sizeof(path), "%s/%s", dir, CGROUP_PROCS_FILE);
+	if (len <= 0 || (size_t)len >= sizeof(path)) {
+		log_err("too long file path: %s/%s", dir, CGROUP_PROCS_FILE);
+		return RET_ERROR;
+	}
+
+	// A descendant cgroup may be removed while we're walking the tree.
+	FILE *fp = fopen(path, "r");
+	if (!fp) {
+		if (nested && (errno == ENOENT || errno == ENODEV)) {
+			return 0;
 		}
+		log_err("%s: %s", path, strerror(errno));
+		return RET_ERROR;
+	}
+	for (int pid; res == 0 && fscanf(fp, "%d", &pid) == 1; ) {
+		res = pid_list_push(pids, (pid_t) pid);
 	}
+	fclose(fp);
 
-	if (flags & FLAG_VERBOSE) {
-		printf("%d\t%s\n", pid, link_path);
-	} else {
-		printf("%d\n", pid);
+	DIR *dirp = opendir(dir);
+	if (!dirp) {
+		if (nested && (errno == ENOENT || errno == ENODEV)) {
+			return res;
+		}
+		log_err("%s: %s", dir, strerror(errno));
+		return RET_ERROR;
+	}
+	struct dirent *entry;
+	while (res == 0 && (entry = readdir(dirp))) {
+		struct stat sb;
+
+		if (entry->d_name[0] == '.') {
+			continue;
+		}
+		len = snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (len <= 0 || (size_t)len >= sizeof(path)) {
+			continue;
+		}
+		if (lstat(path, &sb) == 0 && S_ISDIR(sb.st_mode)) {
+			res = read_cgroup_procs(path, pids, true);
+		}
+	}
+	closedir(dirp);
+
+	return res;
+}
+
+static int cmp_links_by_ppid (const void *a, const void *b) {
+	return cmp_pids(&((const struct proc_link *)a)->ppid, &((const struct proc_link *)b)->ppid);
+}
+
+// Appends the selected process trees roots and all their descendants to
+// *pids*. This walks all processes, but reads just their stat.
+static int read_proc_trees (struct pid_list *pids) {
+	struct proc_link *links = NULL;
+	size_t links_cnt = 0, links_size = 0;
+	int res = 0;
+
+	DIR *dir = opendir(PROCFS_PATH);
+	if (!dir) {
+		log_err("%s: %s", PROCFS_PATH, strerror(errno));
+		return RET_ERROR;
+	}
+	for (pid_t pid, ppid; (pid = next_pid(dir)) != -1; ) {
+		pid_t sid;
+		if (proc_stat_ids(pid, &ppid, &sid) < 0) {
+			continue;
+		}
+		if (links_cnt >= links_size) {
+			size_t new_size = links_size ? links_size * 2 : 1024;
+			struct proc_link *tmp = realloc(links, new_size * sizeof(*tmp));
+			if (!tmp) {
+				log_err("%s", strerror(errno));
+				res = RET_ERROR;
+				break;
+			}
+			links = tmp;
+			links_size = new_size;
+		}
+		links[links_cnt++] = (struct proc_link) { pid, ppid };
+	}
+	closedir(dir);
+
+	if (res == 0) {
+		qsort(links, links_cnt, sizeof(*links), cmp_links_by_ppid);
+	}
+
+	// Breadth-first walk; *pids* itself is used as the queue.
+	size_t i = pids->cnt;
+	foreach(pid_t root, selection.trees, -1, {
+		if (res == 0) res = pid_list_push(pids, root);
+	})
+	for (; res == 0 && i < pids->cnt; i++) {
+		pid_t parent = pids->items[i];
+
+		// Find the first child of *parent* (lower bound).
+		size_t lo = 0, hi = links_cnt;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+			if (links[mid].ppid < parent) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		for (; res == 0 && lo < links_cnt && links[lo].ppid == parent; lo++) {
+			res = pid_list_push(pids, links[lo].pid);
+		}
+	}
+	free(links);
+
+	return res;
+}
+
+// Loads (sorted) PIDs of processes in the selected cgroups and process trees
+// into *selection.pids*, skipping kernel processes.
+static int load_selected_pids (void) {
+	struct pid_list pids = { NULL, 0, 0 };
+	int res = pid_list_push(&pids, -1);  // just to allocate it
+
+	pids.cnt = 0;
+	foreach(const char *dir, selection.cgroups, NULL, {
+		if (res == 0) res = read_cgroup_procs(dir, &pids, false);
+	})
+	if (res == 0 && selection.trees[0] != -1) {
+		res = read_proc_trees(&pids);
+	}
+	if (res < 0) {
+		free(pids.items);
+		return RET_ERROR;
+	}
+	qsort(pids.items, pids.cnt, sizeof(*pids.items), cmp_pids);
+
+	// Remove duplicates and kernel processes.
+	size_t n = 0;
+	for (size_t i = 0; i < pids.cnt; i++) {
+		if ((n == 0 || pids.items[n - 1] != pids.items[i]) && !is_kernel_proc(pids.items[i])) {
+			pids.items[n++] = pids.items[i];
+		}
+	}
+	pids.items[n] = -1;  // mark end of the array
+	pids.cnt = n;
+
+	free(selection.pids.items);
+	selection.pids = pids;
+
+	return 0;
+}
+
+// Returns true if process *pid* matches the selection filters. The checks
+// are ordered from the cheapest, so most processes are rejected without
+// reading anything from procfs.
+static bool proc_selected (pid_t pid) {
+	char path[sizeof(PROC_DIR_PATH) + PID_STR_MAX + 1];
+
+	if (selection.pids.items && !bsearch(&pid, selection.pids.items,
+			selection.pids.cnt, sizeof(pid), cmp_pids)) {
+		return false;
+	}
+	if (selection.uids[0] != (uid_t) -1) {
+		struct stat sb;
+		bool found = false;
+
+		str_fmt(path, sizeof(path), PROC_DIR_PATH, pid);
+		if (stat(path, &sb) < 0) {
+			return false;
+		}
+		foreach(uid_t uid, selection.uids, (uid_t) -1, {
+			if (uid == sb.st_uid) {
+				found = true;
+				break;
+			}
+		})
+		if (!found) {
+			return false;
+		}
 	}
-	return 0;  // yes
+	if (selection.exe_patterns[0]) {
+		char exe[PATH_MAX];
+
+		if (proc_exe_path(pid, exe, sizeof(exe)) < 0
+				|| !fnmatch_any(selection.exe_patterns, exe, 0)) {
+			return false;
+		}
+	}
+	return true;
 }
 
+// Collects files of process *pid* for comparison; see proc_collect_maps().
 static int scan_proc (pid_t pid, const char **file_patterns) {
+	struct proc_ns ns = { .loaded = false };
 
-	int res1 = proc_has_replaced_exe(pid, file_patterns);
-	if (res1 == RET_ERROR) {
+	if (!proc_selected(pid)) {
+		return 1;  // no
+	}
+	stats.procs++;
+
+	if (pid_list_push(&pipeline.procs, pid) < 0) {
 		return RET_ERROR;
-	} else if (res1 == 0 && !(flags & FLAG_VERBOSE)) {
-		return 0;
 	}
+	int res = proc_collect_exe(pid, &ns, file_patterns);
+	if (res == RET_ERROR) {
+		return RET_ERROR;
+	}
+	res *= proc_collect_maps(pid, &ns, file_patterns);
+
+	return res;
+}
+
+// Reports the collected candidates (in order of collection) that are
+// replaced, and deleted files held open by the scanned processes.
+static int report_candidates (const char **file_patterns) {
+	int status = EXIT_SUCCESS;
+	size_t k = 0;
+
+	for (size_t i = 0; i < pipeline.procs.cnt; i++) {
+		pid_t pid = pipeline.procs.items[i];
+		int res = 1;
+
+		if (flags & FLAG_COST) {
+			size_t end = k;
+			while (end < pipeline.candidates_cnt && pipeline.candidates[end].pid == pid) end++;
+			cost.candidates = &pipeline.candidates[k];
+			cost.candidates_cnt = end - k;
+		}
+		for (; k < pipeline.candidates_cnt && pipeline.candidates[k].pid == pid; k++) {
+			struct candidate *c = &pipeline.candidates[k];
+			int cmp_res = c->job ? c->job->result : c->result;
+
+			// Skip identical files and those not compared in the quiet mode.
+			if (cmp_res == 0 || cmp_res == CMP_PENDING) {
+				continue;
+			}
+			// Report only the first file, unless verbose.
+			if (res == 0 && !(flags & FLAG_VERBOSE)) {
+				continue;
+			}
+			res = 0;  // yes
+			report(&(struct record) {
+				.pid = pid,
+				.reason = c->reason,
+				.filename = c->filename,
+				.file = c->mapped,
+				.size = c->size,
+				.suspected = cmp_res == CMP_SUSPECTED,
+				.unknown = cmp_res == CMP_UNKNOWN,
+			});
+		}
+
+		if (flags & FLAG_FDS && !(res == 0 && flags & FLAG_QUIET)) {
+			int res_fds = proc_deleted_fds(pid, file_patterns, res == 0);
+
+			if (res_fds == 0) {
+				res = 0;
+			} else if (res_fds == RET_ERROR && res == 1) {
+				res = RET_ERROR;
+			}
+		}
 
-	int res2 = proc_maps_replaced_files(pid, file_patterns);
-	return res1 * res2;
+		if (res < 0) {
+			status = EXIT_FAILURE;
+		} else if (res == 0 && flags & FLAG_QUIET) {
+			return EXIT_FOUND;
+		}
+	}
+	return status;
 }
 
 static int scan_procs (pid_t *pids, const char **file_patterns) {
 	int status = EXIT_SUCCESS;
 
 	foreach(pid_t pid, pids, -1, {
-		if (scan_proc(pid, file_patterns) < 0) {
+		int res = scan_proc(pid, file_patterns);
+
+		if (res < 0) {
 			status = EXIT_FAILURE;
+		} else if (res == 0 && flags & FLAG_QUIET) {
+			return EXIT_FOUND;
 		}
 	})
 	return status;
@@ -440,8 +3241,13 @@ static int scan_all_procs (const char **file_patterns) {
 		// Skip kernel processes/threads.
 		if (is_kernel_proc(pid)) continue;
 
-		if (scan_proc(pid, file_patterns) < 0) {
+		int res = scan_proc(pid, file_patterns);
+
+		if (res < 0) {
 			status = EXIT_FAILURE;
+		} else if (res == 0 && flags & FLAG_QUIET) {
+			status = EXIT_FOUND;
+			break;
 		}
 	}
 	closedir(dir);
@@ -449,39 +3255,381 @@ static int scan_all_procs (const char **file_patterns) {
 	return status;
 }
 
+// Scans processes *pids*, or all processes if *pids* is NULL. When scanning
+// all processes, ignore those we don't have permissions to examine, unless
+// we are root. The scan runs in three phases: deleted mapped files of all the
+// processes are collected first, then the unique comparisons are resolved
+// (in parallel), and finally the results are reported.
+static int scan (pid_t *pids, const char **file_patterns) {
+	unsigned int orig_flags = flags;
+	int status;
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	limits.start = start;
+	memset(&stats, 0, sizeof(stats));
+	cache_clear(&ns_verdicts);
+	cache_clear(&deleted_fds);
+	cache_clear(&fs_types);
+	cost.pid = -1;
+	proc_info.pid = -1;
+
+	// Cgroups and trees are read again on each scan, since processes come
+	// and go.
+	if ((selection.cgroups[0] || selection.trees[0] != -1) && load_selected_pids() < 0) {
+		return EXIT_FAILURE;
+	}
+
+	if (!pids && geteuid() != 0) {
+		flags |= FLAG_IGNORE_EACCES;
+	}
+	if (pids) {
+		status = scan_procs(pids, file_patterns);
+	// There's no need to walk all processes if we know which to scan.
+	} else if (selection.pids.items) {
+		status = scan_procs(selection.pids.items, file_patterns);
+	} else {
+		status = scan_all_procs(file_patterns);
+	}
+	// In the quiet mode, it's done if anything has been found already.
+	if (status != EXIT_FOUND) {
+		resolve_jobs();
+
+		int res = report_candidates(file_patterns);
+		if (res == EXIT_FOUND || status == EXIT_SUCCESS) {
+			status = res;
+		}
+	}
+	if (deadline_left() == 0) {
+		log_err("deadline exceeded, %lu files not compared", stats.files_unknown);
+	}
+	flags = orig_flags;
+
+	pipeline_clear();
+	groups_flush();
+	by_file_flush();
+
+	if (flags & FLAG_COST && !(flags & FLAG_QUIET)) {
+		fprintf(stderr, PROGNAME ": stale mappings use %lu kB RSS, %lu kB PSS in total\n",
+		        stats.stale.rss, stats.stale.pss);
+	}
+	if (flags & FLAG_FDS && !(flags & FLAG_QUIET)) {
+		fprintf(stderr, PROGNAME ": deleted open files use %lld bytes in total\n",
+		        (long long) stats.deleted_size);
+	}
+	if (flags & FLAG_TIMING) {
+		fprintf(stderr, PROGNAME ": scanned %lu processes, compared %lu files (%lu cached) in %.3f s",
+		        stats.procs, stats.files_compared, stats.files_cached, elapsed_since(&start));
+		if (throttle.bytes_rate > 0 || throttle.ops_rate > 0 || pressure.enabled) {
+			fprintf(stderr, " (throttled for %.3f s)", stats.throttled);
+		}
+		if (stats.files_unknown > 0) {
+			fprintf(stderr, ", %lu files timed out", stats.files_unknown);
+		}
+		fprintf(stderr, "\n");
+	}
+	return status;
+}
+
+// Reads requests from STDIN until EOF and writes results to STDOUT. Each
+// request is a line with PIDs to scan, or "*" to scan all processes. Each
+// result is terminated by line "=<status>" and flushed.
+static int serve (const char **file_patterns) {
+	size_t line_size = 0;
+	char *line = NULL;
+
+	size_t pids_size = 64;
+	pid_t *pids = malloc(pids_size * sizeof(*pids));
+
+	if (!pids) {
+		log_err("%s", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	while (getline(&line, &line_size, stdin) != -1) {
+		int status = EXIT_SUCCESS;
+		bool all = false;
+		size_t cnt = 0;
+
+		for (char *tok = strtok(line, " \t\n"); tok; tok = strtok(NULL, " \t\n")) {
+			int pid;
+
+			if (strcmp(tok, "*") == 0) {
+				all = true;
+			} else if ((pid = str_to_uint(tok)) < 1) {
+				log_err("invalid argument: %s", tok);
+				status = EXIT_WRONG_USAGE;
+				break;
+			} else {
+				if (cnt + 1 >= pids_size) {
+					pid_t *tmp = realloc(pids, pids_size * 2 * sizeof(*pids));
+					if (!tmp) {
+						log_err("%s", strerror(errno));
+						status = EXIT_FAILURE;
+						break;
+					}
+					pids = tmp;
+					pids_size *= 2;
+				}
+				pids[cnt++] = (pid_t) pid;
+			}
+		}
+		pids[cnt] = -1;  // mark end of the array
+
+		if (status != EXIT_SUCCESS) {
+			// don't scan anything
+		} else if (all) {
+			status = scan(NULL, file_patterns);
+		} else if (cnt > 0) {
+			status = scan(pids, file_patterns);
+		} else {
+			continue;  // skip empty lines
+		}
+		printf("=%d\n", status);
+		fflush(stdout);
+	}
+
+	free(line);
+	free(pids);
+
+	return EXIT_SUCCESS;
+}
+
+// Parses user name or UID *str*; returns -1 if not found.
+static uid_t parse_user (const char *str) {
+	int uid = str_to_uint(str);
+	if (uid >= 0) {
+		return (uid_t) uid;
+	}
+	struct passwd *pw = getpwnam(str);
+
+	return pw ? pw->pw_uid : (uid_t) -1;
+}
+
+// Parses "RESOURCE=PERCENT" into the pressure thresholds. Returns 0 on
+// success, RET_ERROR otherwise.
+static int parse_pressure (const char *str) {
+	const char *sep = strchr(str, '=');
+
+	if (!sep) {
+		return RET_ERROR;
+	}
+	for (size_t i = 0; PRESSURE_NAMES[i]; i++) {
+		if (strlen(PRESSURE_NAMES[i]) == (size_t)(sep - str)
+				&& strncmp(PRESSURE_NAMES[i], str, (size_t)(sep - str)) == 0) {
+			char *end;
+			double pct = strtod(sep + 1, &end);
+
+			if (end == sep + 1 || *end != '\0' || !(pct > 0 && pct <= 100)) {
+				return RET_ERROR;
+			}
+			pressure.max[i] = pct;
+			pressure.enabled = true;
+			return 0;
+		}
+	}
+	return RET_ERROR;
+}
+
+// Parses "TYPE=POLICY" into *fp*, where TYPE is a filesystem type as in the
+// mount table. Returns 0 on success, RET_ERROR otherwise.
+static int parse_fs_policy (const char *str, struct fs_policy *fp) {
+	const char *sep = strchr(str, '=');
+
+	if (!sep || sep == str) {
+		return RET_ERROR;
+	}
+	fp->type = str;
+	fp->type_len = (size_t)(sep - str);
+
+	for (size_t i = 0; FS_POLICY_NAMES[i]; i++) {
+		if (strcmp(FS_POLICY_NAMES[i], sep + 1) == 0) {
+			fp->policy = (int) i;
+			return 0;
+		}
+	}
+	return RET_ERROR;
+}
+
 int main (int argc, char **argv) {
+	if (argc == 5 && strcmp(argv[1], CMP_HELPER_ARG) == 0) {
+		return cmp_helper(argv[2], argv[3], argv[4]);
+	}
+
 	const char *file_patterns[argc + 1];
 	file_patterns[0] = NULL;
 
+	const char *cgroups[argc + 1];
+	const char *exe_patterns[argc + 1];
+	pid_t trees[argc + 1];
+	uid_t uids[argc + 1];
+	struct fs_policy policies[argc + 1];
+
+	selection.cgroups = cgroups;
+	selection.exe_patterns = exe_patterns;
+	selection.trees = trees;
+	selection.uids = uids;
+	fs_policies.items = policies;
+
 	{
 		int optch;
-		int f_cnt = 0;
+		int f_cnt = 0, c_cnt = 0, e_cnt = 0, p_cnt = 0, u_cnt = 0;
 
 		opterr = 0;  // don't print implicit error message on unrecognized option
-		while ((optch = getopt(argc, argv, "f:hVv")) != -1) {
+		while ((optch = getopt_long(argc, argv, "0bc:D:de:Ff:ghI:j:L:mo:P:p:qR:ST:tu:Vv", LONG_OPTS, NULL)) != -1) {
 			switch (optch) {
 				case 'f':
 					file_patterns[f_cnt++] = (char *)optarg;
 					break;
+				case 'b':
+					flags |= FLAG_BY_FILE | FLAG_VERBOSE;
+					break;
+				case 'c':
+					cgroups[c_cnt++] = (char *)optarg;
+					break;
+				case 'd':
+					flags |= FLAG_FDS;
+					break;
+				case 'e':
+					exe_patterns[e_cnt++] = (char *)optarg;
+					break;
+				case 'F':
+					flags |= FLAG_FAST;
+					break;
+				case 'j': {
+					int n = str_to_uint(optarg);
+					if (n < 1) {
+						log_err("invalid number of jobs: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					workers_max = (unsigned int) n;
+					break;
+				}
+				case 'D':
+				case 'T': {
+					char *end;
+					double secs = strtod(optarg, &end);
+					if (end == optarg || *end != '\0' || !(secs > 0)) {
+						log_err("invalid number of seconds: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					if (optch == 'D') {
+						limits.deadline = secs;
+					} else {
+						limits.timeout = secs;
+					}
+					break;
+				}
+				case 'I':
+				case 'R': {
+					int n = str_to_uint(optarg);
+					if (n < 1) {
+						log_err("invalid rate: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					if (optch == 'I') {
+						throttle.ops_rate = n;
+					} else {
+						throttle.bytes_rate = n * 1024.0 * 1024.0;
+					}
+					break;
+				}
+				case 'L':
+					if (parse_pressure(optarg) < 0) {
+						log_err("invalid pressure limit: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					break;
+				case 'm':
+					flags |= FLAG_COST;
+					break;
+				case 'P':
+					if (parse_fs_policy(optarg, &policies[fs_policies.cnt++]) < 0) {
+						log_err("invalid filesystem policy: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					break;
+				case '0':
+					flags = (flags & ~FLAG_JSON) | FLAG_NUL;
+					break;
+				case 'o':
+					flags &= ~(FLAG_JSON | FLAG_NUL);
+					if (strcmp(optarg, "json") == 0) {
+						flags |= FLAG_JSON;
+					} else if (strcmp(optarg, "nul") == 0) {
+						flags |= FLAG_NUL;
+					} else if (strcmp(optarg, "text") != 0) {
+						log_err("invalid format: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					break;
+				case 'p':
+					if ((trees[p_cnt++] = str_to_uint(optarg)) < 1) {
+						log_err("invalid PID: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					break;
+				case 'q':
+					flags |= FLAG_QUIET;
+					break;
+				case 'S':
+					flags |= FLAG_SERVE;
+					break;
+				case 't':
+					flags |= FLAG_TIMING;
+					break;
+				case 'u':
+					if ((uids[u_cnt++] = parse_user(optarg)) == (uid_t) -1) {
+						log_err("invalid user: %s", optarg);
+						return EXIT_WRONG_USAGE;
+					}
+					break;
 				case 'v':
 					flags |= FLAG_VERBOSE;
 					break;
+				case 'g':
+					flags |= FLAG_GROUP;
+					break;
 				case 'h':
-					printf("%s", HELP_MSG);
+					printf("%s%s", HELP_MSG, HELP_MSG_TAIL);
 					return EXIT_SUCCESS;
 				case 'V':
 					printf("%s %s\n", PROGNAME, STR(VERSION));
 					return EXIT_SUCCESS;
 				default:
-					log_err("invalid option: -%c\n", optopt);
-					fprintf(stderr, "%s", HELP_MSG);
+					if (optopt) {
+						log_err("invalid option: -%c\n", optopt);
+					} else {
+						log_err("invalid option: %s\n", argv[optind - 1]);
+					}
+					fprintf(stderr, "%s%s", HELP_MSG, HELP_MSG_TAIL);
 					return EXIT_WRONG_USAGE;
 			}
 		}
-		file_patterns[f_cnt] = NULL;  // mark end of the array
+		// mark end of the arrays
+		file_patterns[f_cnt] = NULL;
+		cgroups[c_cnt] = NULL;
+		exe_patterns[e_cnt] = NULL;
+		trees[p_cnt] = -1;
+		uids[u_cnt] = (uid_t) -1;
+	}
+
+	// There's nothing to report in the quiet mode.
+	if (flags & FLAG_QUIET) {
+		flags &= ~(unsigned int)FLAG_VERBOSE;
 	}
+	if (pressure.enabled) {
+		pressure_init();
+	}
+
+	if (flags & FLAG_SERVE) {
+		if (optind < argc) {
+			log_err("%s", "PIDs cannot be specified in the serve mode");
+			return EXIT_WRONG_USAGE;
+		}
+		return serve(file_patterns);
 
-	if (optind < argc) {
+	} else if (optind < argc) {
 		pid_t pids[argc - optind + 1];
 		pids[0] = -1;
 
@@ -494,12 +3642,9 @@ int main (int argc, char **argv) {
 		}
 		pids[argc - optind] = -1;  // mark end of the array
 
-		return scan_procs(pids, file_patterns);
+		return scan(pids, file_patterns);
 
 	} else {
-		if (geteuid() != 0) {
-			flags |= FLAG_IGNORE_EACCES;
-		}
-		return scan_all_procs(file_patterns);
+		return scan(NULL, file_patterns);
 	}
 }